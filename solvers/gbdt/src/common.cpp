@@ -2,6 +2,7 @@
 #include <cstring>
 #include <cassert>
 #include <algorithm>
+#include <limits>
 #include <omp.h>
 
 #include "common.h"
@@ -151,6 +152,57 @@ Problem read_data(std::string const &dense_path, std::string const &sparse_path)
     return prob;
 }
 
+// rows must be in ascending order; row rows[i] of prob becomes row i.
+Problem subset_problem(Problem const &prob, std::vector<uint32_t> const &rows)
+{
+    uint32_t const nr_instance = static_cast<uint32_t>(rows.size());
+    uint32_t const none = std::numeric_limits<uint32_t>::max();
+
+    Problem sub(nr_instance, prob.nr_field);
+
+    std::vector<uint32_t> new_idx(prob.nr_instance, none);
+    for(uint32_t i = 0; i < nr_instance; ++i)
+    {
+        new_idx[rows[i]] = i;
+        sub.Y[i] = prob.Y[rows[i]];
+    }
+
+    #pragma omp parallel for schedule(static)
+    for(uint32_t j = 0; j < prob.nr_field; ++j)
+    {
+        uint32_t p = 0;
+        for(Node const &node : prob.X[j])
+        {
+            uint32_t const i = new_idx[node.i];
+            if(i == none)
+                continue;
+            sub.X[j][p] = Node(i, node.v);
+            sub.Z[j][i] = Node(p, node.v);
+            ++p;
+        }
+    }
+
+    sub.SJP.push_back(0);
+    for(auto i : rows)
+    {
+        sub.SJ.insert(sub.SJ.end(), prob.SJ.begin()+prob.SJP[i], 
+            prob.SJ.begin()+prob.SJP[i+1]);
+        sub.SJP.push_back(sub.SJ.size());
+    }
+
+    sub.nr_sparse_field = prob.nr_sparse_field;
+    sub.SIP.push_back(0);
+    for(uint32_t j = 0; j < prob.nr_sparse_field; ++j)
+    {
+        for(uint64_t p = prob.SIP[j]; p < prob.SIP[j+1]; ++p)
+            if(new_idx[prob.SI[p]] != none)
+                sub.SI.push_back(new_idx[prob.SI[p]]);
+        sub.SIP.push_back(sub.SI.size());
+    }
+
+    return sub;
+}
+
 FILE *open_c_file(std::string const &path, std::string const &mode)
 {
     FILE *f = fopen(path.c_str(), mode.c_str());
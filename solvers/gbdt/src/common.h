@@ -56,6 +56,8 @@ construct_instance(Problem const &prob, uint32_t const i)
 Problem read_data(std::string const &dense_path, 
     std::string const &sparse_path);
 
+Problem subset_problem(Problem const &prob, std::vector<uint32_t> const &rows);
+
 FILE *open_c_file(std::string const &path, std::string const &mode);
 
 std::vector<std::string> 
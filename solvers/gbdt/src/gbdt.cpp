@@ -19,10 +19,10 @@ We recommend you either check the above document, or use some exisiting packages
 
 namespace {
 
-float calc_bias(std::vector<float> const &Y)
+float calc_bias(std::vector<float> const &Y, std::vector<float> const &W)
 {
-    double y_bar = std::accumulate(Y.begin(), Y.end(), 0.0);
-    y_bar /= static_cast<double>(Y.size());
+    double y_bar = std::inner_product(Y.begin(), Y.end(), W.begin(), 0.0);
+    y_bar /= std::accumulate(W.begin(), W.end(), 0.0);
     return static_cast<float>(log((1.0+y_bar)/(1.0-y_bar)));
 }
 
@@ -159,7 +159,7 @@ std::mutex CART::mtx;
 bool CART::verbose = false;
 
 void CART::fit(Problem const &prob, std::vector<float> const &R, 
-    std::vector<float> &F1)
+    std::vector<float> const &W, std::vector<float> &F1)
 {
     uint32_t const nr_field = prob.nr_field;
     uint32_t const nr_sparse_field = prob.nr_sparse_field;
@@ -289,7 +289,7 @@ void CART::fit(Problem const &prob, std::vector<float> const &R,
         float const r = locations[i].r;
         uint32_t const tnode_idx = locations[i].tnode_idx;
         tmp[tnode_idx].first += r;
-        tmp[tnode_idx].second += fabs(r)*(1-fabs(r));
+        tmp[tnode_idx].second += fabs(r)*(1-fabs(r)/W[i]);
     }
 
     for(uint32_t tnode_idx = 1; tnode_idx <= max_tnodes; ++tnode_idx)
@@ -322,9 +322,12 @@ std::pair<uint32_t, float> CART::predict(float const * const x) const
     return std::make_pair(-1, -1);
 }
 
-void GBDT::fit(Problem const &Tr, Problem const &Va)
+// W holds the weight of every training instance in the gradient and in the
+// loss; with negative sampling it is 1/rate for the kept negatives.
+void GBDT::fit(Problem const &Tr, Problem const &Va, std::vector<float> const &W)
 {
-    bias = calc_bias(Tr.Y);
+    bias = calc_bias(Tr.Y, W);
+    double const Tr_weight = std::accumulate(W.begin(), W.end(), 0.0);
 
     std::vector<float> F_Tr(Tr.nr_instance, bias), F_Va(Va.nr_instance, bias);
 
@@ -339,18 +342,18 @@ void GBDT::fit(Problem const &Tr, Problem const &Va)
 
         #pragma omp parallel for schedule(static)
         for(uint32_t i = 0; i < Tr.nr_instance; ++i) 
-            R[i] = static_cast<float>(Y[i]/(1+exp(Y[i]*F_Tr[i])));
+            R[i] = static_cast<float>(W[i]*Y[i]/(1+exp(Y[i]*F_Tr[i])));
 
-        trees[t].fit(Tr, R, F1);
+        trees[t].fit(Tr, R, W, F1);
 
         double Tr_loss = 0;
         #pragma omp parallel for schedule(static) reduction(+: Tr_loss)
         for(uint32_t i = 0; i < Tr.nr_instance; ++i) 
         {
             F_Tr[i] += F1[i];
-            Tr_loss += log(1+exp(-Y[i]*F_Tr[i]));
+            Tr_loss += W[i]*log(1+exp(-Y[i]*F_Tr[i]));
         }
-        Tr_loss /= static_cast<double>(Tr.nr_instance);
+        Tr_loss /= Tr_weight;
 
         #pragma omp parallel for schedule(static)
         for(uint32_t i = 0; i < Va.nr_instance; ++i)
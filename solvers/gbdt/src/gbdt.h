@@ -21,7 +21,7 @@ public:
             tnodes[i].idx = i;
     }
     void fit(Problem const &prob, std::vector<float> const &R, 
-        std::vector<float> &F1);
+        std::vector<float> const &W, std::vector<float> &F1);
     std::pair<uint32_t, float> predict(float const * const x) const;
 
     static uint32_t max_depth, max_tnodes;
@@ -36,7 +36,7 @@ class GBDT
 {
 public:
     GBDT(uint32_t const nr_tree) : trees(nr_tree), bias(0) {}
-    void fit(Problem const &Tr, Problem const &Va);
+    void fit(Problem const &Tr, Problem const &Va, std::vector<float> const &W);
     float predict(float const * const x) const;
     std::vector<uint32_t> get_indices(float const * const x) const;
 
@@ -9,9 +9,10 @@ namespace {
 
 struct Option
 {
-    Option() : nr_tree(30), nr_thread(1) {}
+    Option() : nr_tree(30), nr_thread(1), neg_rate(1) {}
     std::string Tr_path, TrS_path, Va_path, VaS_path, Va_out_path, Tr_out_path;
     uint32_t nr_tree, nr_thread;
+    float neg_rate;
 };
 
 std::string train_help()
@@ -21,6 +22,7 @@ std::string train_help()
 "\n"
 "options:\n"
 "-d <depth>: set the maximum depth of a tree\n"
+"-n <rate>: train on all positives and a fraction <rate> of the negatives, weighting each kept negative by 1/<rate>\n"
 "-s <nr_thread>: set the maximum number of threads\n"
 "-t <nr_tree>: set the number of trees\n");
 }
@@ -43,6 +45,14 @@ Option parse_option(std::vector<std::string> const &args)
                 throw std::invalid_argument("invalid command");
             CART::max_depth = std::stoi(args[++i]);
         }
+        else if(args[i].compare("-n") == 0)
+        {
+            if(i == argc-1)
+                throw std::invalid_argument("invalid command");
+            opt.neg_rate = std::stof(args[++i]);
+            if(opt.neg_rate <= 0 || opt.neg_rate > 1)
+                throw std::invalid_argument("invalid sampling rate");
+        }
         else if(args[i].compare("-t") == 0)
         {
             if(i == argc-1)
@@ -74,6 +84,22 @@ Option parse_option(std::vector<std::string> const &args)
     return opt;
 }
 
+// Whether row i with label y is trained on when negatives are sampled at
+// rate. A negative is kept if a hash of i falls below rate, the same rule as
+// ffm-train --neg-sample uses.
+bool keep_instance(float const y, uint64_t const i, float const rate)
+{
+    if(y > 0 || rate >= 1)
+        return true;
+
+    uint64_t h = i*0x9E3779B97F4A7C15ULL;
+    h = (h^(h>>30))*0xBF58476D1CE4E5B9ULL;
+    h = (h^(h>>27))*0x94D049BB133111EBULL;
+    h ^= h>>31;
+
+    return static_cast<double>(h>>11)/static_cast<double>(1ULL<<53) < rate;
+}
+
 void write(Problem const &prob, GBDT const &gbdt, std::string const &path)
 {
     FILE *f = open_c_file(path, "w");
@@ -115,7 +141,24 @@ int main(int const argc, char const * const * const argv)
 	omp_set_num_threads(static_cast<int>(opt.nr_thread));
 
     GBDT gbdt(opt.nr_tree);
-    gbdt.fit(Tr, Va);
+    if(opt.neg_rate < 1)
+    {
+        std::vector<uint32_t> rows;
+        std::vector<float> W;
+        for(uint32_t i = 0; i < Tr.nr_instance; ++i)
+        {
+            if(!keep_instance(Tr.Y[i], i, opt.neg_rate))
+                continue;
+            rows.push_back(i);
+            W.push_back(Tr.Y[i] > 0? 1.0f : 1/opt.neg_rate);
+        }
+        Problem const TrSub = subset_problem(Tr, rows);
+        gbdt.fit(TrSub, Va, W);
+    }
+    else
+    {
+        gbdt.fit(Tr, Va, std::vector<float>(Tr.nr_instance, 1));
+    }
 
     write(Tr, gbdt, opt.Tr_out_path);
     write(Va, gbdt, opt.Va_out_path);
@@ -0,0 +1,62 @@
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ffm.h"
+
+using namespace std;
+using namespace ffm;
+
+struct Option
+{
+    string model_path, delta_path;
+};
+
+string apply_delta_help()
+{
+    return string(
+"usage: ffm-apply-delta model_file delta_file\n"
+"\n"
+"Replace the rows of the binary model_file that are in delta_file, written by\n"
+"`ffm-train --delta'. model_file is patched in place, so predictors that have it\n"
+"mapped see the new rows without reloading it.\n");
+}
+
+Option parse_option(int argc, char **argv)
+{
+    vector<string> args;
+    for(int i = 0; i < argc; i++)
+        args.push_back(string(argv[i]));
+
+    if(argc != 3)
+        throw invalid_argument(apply_delta_help());
+
+    Option opt;
+    opt.model_path = args[1];
+    opt.delta_path = args[2];
+
+    return opt;
+}
+
+int main(int argc, char **argv)
+{
+    Option opt;
+    try
+    {
+        opt = parse_option(argc, argv);
+    }
+    catch(invalid_argument const &e)
+    {
+        cout << e.what() << endl;
+        return 1;
+    }
+
+    if(ffm_apply_delta(opt.model_path.c_str(), opt.delta_path.c_str()) != 0)
+    {
+        cerr << "cannot apply " << opt.delta_path << " to " << opt.model_path << endl;
+        return 1;
+    }
+
+    return 0;
+}
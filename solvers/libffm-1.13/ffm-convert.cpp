@@ -0,0 +1,103 @@
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ffm.h"
+
+using namespace std;
+using namespace ffm;
+
+struct Option
+{
+    Option() : force(false) {}
+    string txt_path, bin_path;
+    bool force;
+};
+
+string convert_help()
+{
+    return string(
+"usage: ffm-convert [options] text_file [binary_file]\n"
+"\n"
+"Convert a data set to the binary format used by `ffm-train --on-disk'.\n"
+"binary_file defaults to <text_file>.bin in the current directory.\n"
+"\n"
+"options:\n"
+"-f: convert even if binary_file is an up-to-date conversion of text_file\n");
+}
+
+string basename(string path)
+{
+    const char *ptr = strrchr(&*path.begin(), '/');
+    if(!ptr)
+        ptr = path.c_str();
+    else
+        ptr++;
+    return string(ptr);
+}
+
+Option parse_option(int argc, char **argv)
+{
+    vector<string> args;
+    for(int i = 0; i < argc; i++)
+        args.push_back(string(argv[i]));
+
+    if(argc == 1)
+        throw invalid_argument(convert_help());
+
+    Option opt;
+
+    int i = 1;
+    for(; i < argc; i++)
+    {
+        if(args[i].compare("-f") == 0)
+        {
+            opt.force = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(i != argc-1 && i != argc-2)
+        throw invalid_argument("cannot parse argument");
+
+    opt.txt_path = args[i];
+    if(i == argc-2)
+        opt.bin_path = args[i+1];
+    else
+        opt.bin_path = basename(opt.txt_path) + ".bin";
+
+    return opt;
+}
+
+int main(int argc, char **argv)
+{
+    Option opt;
+    try
+    {
+        opt = parse_option(argc, argv);
+    }
+    catch(invalid_argument const &e)
+    {
+        cout << e.what() << endl;
+        return 1;
+    }
+
+    if(!opt.force && ffm_bin_problem_up_to_date(opt.txt_path.c_str(), opt.bin_path.c_str()))
+    {
+        cout << opt.bin_path << " is up to date" << endl;
+        return 0;
+    }
+
+    if(ffm_read_problem_to_disk(opt.txt_path.c_str(), opt.bin_path.c_str()) != 0)
+    {
+        cerr << "cannot convert " << opt.txt_path << " to " << opt.bin_path << endl;
+        return 1;
+    }
+
+    return 0;
+}
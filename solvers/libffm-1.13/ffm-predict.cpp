@@ -1,5 +1,5 @@
 #include <cstring>
-#include <fstream>
+#include <cstdio>
 #include <iostream>
 #include <string>
 #include <iomanip>
@@ -9,6 +9,10 @@
 #include <vector>
 #include <cstdlib>
 
+#if defined USEOMP
+#include <omp.h>
+#endif
+
 #include "ffm.h"
 
 using namespace std;
@@ -16,13 +20,19 @@ using namespace ffm;
 
 struct Option
 {
-    string test_path, model_path, output_path;
+    Option() : nr_threads(1) {}
+    string test_path, model_path, output_path, mask_path;
+    ffm_int nr_threads;
 };
 
 string predict_help()
 {
     return string(
-"usage: ffm-predict test_file model_file output_file\n");
+"usage: ffm-predict [options] test_file model_file output_file\n"
+"\n"
+"options:\n"
+"-s <nr_threads>: set number of threads (default 1)\n"
+"--mask <path>: leave out the pairs of fields listed in <path> (see ffm-rank-pairs)\n");
 }
 
 Option parse_option(int argc, char **argv)
@@ -36,65 +46,264 @@ Option parse_option(int argc, char **argv)
 
     Option option;
 
-    if(argc != 4)
+    int i = 1;
+    for(; i < argc; i++)
+    {
+        if(args[i].compare("-s") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify number of threads after -s");
+            i++;
+            option.nr_threads = atoi(args[i].c_str());
+            if(option.nr_threads <= 0)
+                throw invalid_argument("number of threads should be greater than zero");
+        }
+        else if(args[i].compare("--mask") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --mask");
+            i++;
+            option.mask_path = args[i];
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(i != argc-3)
         throw invalid_argument("cannot parse argument");
 
-    option.test_path = string(args[1]);
-    option.model_path = string(args[2]);
-    option.output_path = string(args[3]);
+    option.test_path = string(args[i]);
+    option.model_path = string(args[i+1]);
+    option.output_path = string(args[i+2]);
 
     return option;
 }
 
-void predict(string test_path, string model_path, string output_path)
+// Parse the line [begin, end) with the library's parser and append its nodes
+// to X.
+ffm_float parse_line(char const *begin, char const *end, vector<ffm_node> &X)
+{
+    size_t size = X.size();
+    ffm_int max_nodes = (ffm_int)((end-begin)/2+1);
+    X.resize(size+max_nodes);
+
+    ffm_float y;
+    ffm_int nr_nodes = ffm_parse_line(begin, end, &y, X.data()+size, max_nodes);
+    X.resize(size+nr_nodes);
+
+    return y;
+}
+
+// Write y in the same form as printf("%g"), i.e. with six significant digits
+// and no trailing zeros. Probabilities that need an exponent are rare and are
+// handed to snprintf.
+char* format_prob(ffm_float y, char *ptr)
 {
-    int const kMaxLineSize = 1000000;
+    static long long const pow10[] = {1000000LL, 10000000LL, 100000000LL, 1000000000LL};
 
-    FILE *f_in = fopen(test_path.c_str(), "r");
-    ofstream f_out(output_path);
-    char line[kMaxLineSize];
+    ffm_double x = y;
+    if(!(x >= 1e-4 && x < 1))
+        return ptr + sprintf(ptr, "%g", x);
 
-    ffm_model *model = ffm_load_model(model_path.c_str());
+    ffm_int e = x >= 1e-1? 1 : x >= 1e-2? 2 : x >= 1e-3? 3 : 4;
+    long long digits = llround(x*pow10[e-1]);
+    if(digits >= 1000000LL)
+        return ptr + sprintf(ptr, "%g", x);
+
+    *ptr++ = '0';
+    *ptr++ = '.';
+    for(ffm_int i = 1; i < e; i++)
+        *ptr++ = '0';
+
+    char buf[6];
+    for(ffm_int i = 5; i >= 0; i--, digits /= 10)
+        buf[i] = '0' + digits%10;
+    ffm_int len = 6;
+    while(buf[len-1] == '0')
+        len--;
+    memcpy(ptr, buf, len);
+
+    return ptr+len;
+}
+
+int predict(Option const &opt)
+{
+    size_t const kChunkSize = 64<<20;
+    size_t const kMaxOutputSize = 32;
+
+    FILE *f_in = fopen(opt.test_path.c_str(), "rb");
+    if(f_in == nullptr)
+    {
+        cerr << "cannot load " << opt.test_path << endl;
+        return 1;
+    }
+
+    ffm_qmodel *qmodel = nullptr;
+    ffm_model *model = nullptr;
+    if(ffm_is_qmodel(opt.model_path.c_str()))
+        qmodel = ffm_load_qmodel(opt.model_path.c_str());
+    else
+        model = ffm_load_model(opt.model_path.c_str());
+    if(qmodel == nullptr && model == nullptr)
+    {
+        cerr << "cannot load " << opt.model_path << endl;
+        fclose(f_in);
+        return 1;
+    }
 
+    if(!opt.mask_path.empty())
+    {
+        ffm_pair_mask *mask = ffm_read_pair_mask(opt.mask_path.c_str());
+        if(mask == nullptr || qmodel != nullptr)
+        {
+            if(mask == nullptr)
+                cerr << "cannot load " << opt.mask_path << endl;
+            else
+                cerr << "cannot use a pair mask with a quantized model" << endl;
+            fclose(f_in);
+            ffm_destroy_model(&model);
+            ffm_destroy_qmodel(&qmodel);
+            ffm_destroy_pair_mask(&mask);
+            return 1;
+        }
+        ffm_set_pair_mask(model, mask);
+        ffm_destroy_pair_mask(&mask);
+    }
+
+    FILE *f_out = fopen(opt.output_path.c_str(), "wb");
+    if(f_out == nullptr)
+    {
+        cerr << "cannot write " << opt.output_path << endl;
+        fclose(f_in);
+        ffm_destroy_model(&model);
+        ffm_destroy_qmodel(&qmodel);
+        return 1;
+    }
+
+    ffm_int nr_threads = opt.nr_threads;
+    vector<vector<char>> outputs(nr_threads);
+
+    vector<char> buffer(kChunkSize+1);
+    vector<pair<char const*, char const*>> lines;
+    size_t carry = 0;
     ffm_double loss = 0;
-    vector<ffm_node> x;
-    ffm_int i = 0;
+    ffm_long nr_instances = 0;
 
-    for(; fgets(line, kMaxLineSize, f_in) != nullptr; i++)
+    // Read the file in large chunks. Only complete lines are scored; the tail
+    // of a chunk is moved to the front of the buffer and completed by the next
+    // read.
+    while(true)
     {
-        x.clear();
-        char *y_char = strtok(line, " \t");
-        ffm_float y = (atoi(y_char)>0)? 1.0f : -1.0f;
+        size_t size = carry + fread(buffer.data()+carry, 1, buffer.size()-1-carry, f_in);
+        bool eof = size < buffer.size()-1;
+
+        char *begin = buffer.data();
+        char *end = buffer.data()+size;
+
+        lines.clear();
+        char *ptr = begin;
+        while(ptr < end)
+        {
+            char *nl = (char*)memchr(ptr, '\n', end-ptr);
+            if(nl == nullptr)
+            {
+                if(!eof)
+                    break;
+                nl = end;
+            }
+            lines.push_back(make_pair(ptr, nl));
+            ptr = nl+1;
+        }
+        carry = end > ptr? end-ptr : 0;
 
-        while(true)
+        if(lines.empty() && !eof)
         {
-            char *field_char = strtok(nullptr,":");
-            char *idx_char = strtok(nullptr,":");
-            char *value_char = strtok(nullptr," \t");
-            if(field_char == nullptr || *field_char == '\n')
-                break;
-
-            ffm_node N;
-            N.f = atoi(field_char);
-            N.j = atoi(idx_char);
-            N.v = atof(value_char);
-
-            x.push_back(N);
+            // A single line does not fit into the buffer.
+            buffer.resize(buffer.size()*2);
+            continue;
         }
 
-        ffm_float y_bar = ffm_predict(x.data(), x.data()+x.size(), model);
+        ffm_long nr_lines = lines.size();
+        ffm_double chunk_loss = 0;
 
-        loss -= y==1? log(y_bar) : log(1-y_bar);
+#if defined USEOMP
+#pragma omp parallel num_threads(nr_threads) reduction(+: chunk_loss)
+#endif
+        {
+#if defined USEOMP
+            ffm_int tid = omp_get_thread_num();
+            ffm_int nt = omp_get_num_threads();
+#else
+            ffm_int tid = 0;
+            ffm_int nt = 1;
+#endif
+            ffm_long lo = nr_lines*tid/nt;
+            ffm_long hi = nr_lines*(tid+1)/nt;
+
+            vector<char> &output = outputs[tid];
+            output.resize((hi-lo)*kMaxOutputSize);
+            char *out = output.data();
+
+            vector<ffm_node> X;
+            vector<ffm_long> P(1, 0);
+            vector<ffm_float> Y, Y_bar(hi-lo);
+            for(ffm_long p = lo; p < hi; p++)
+            {
+                Y.push_back(parse_line(lines[p].first, lines[p].second, X));
+                P.push_back(X.size());
+            }
+
+            if(qmodel != nullptr)
+            {
+                for(ffm_long i = 0; i < hi-lo; i++)
+                    Y_bar[i] = ffm_qpredict(&X[P[i]], &X[P[i+1]], qmodel);
+            }
+            else
+            {
+                ffm_predict_batch(X.data(), P.data(), nullptr, hi-lo, model, Y_bar.data(), 1);
+            }
+
+            for(ffm_long i = 0; i < hi-lo; i++)
+            {
+                ffm_float y = Y[i];
+                ffm_float y_bar = Y_bar[i];
+
+                chunk_loss -= y==1? log(y_bar) : log(1-y_bar);
+
+                out = format_prob(y_bar, out);
+                *out++ = '\n';
+            }
+            output.resize(out-output.data());
+        }
+
+        for(ffm_int t = 0; t < nr_threads; t++)
+        {
+            fwrite(outputs[t].data(), 1, outputs[t].size(), f_out);
+            outputs[t].clear();
+        }
 
-        f_out << y_bar << "\n";
+        loss += chunk_loss;
+        nr_instances += nr_lines;
+
+        if(eof)
+            break;
+
+        memmove(buffer.data(), ptr, carry);
     }
 
-    loss /= i;
+    loss /= nr_instances;
 
     cout << "logloss = " << fixed << setprecision(5) << loss << endl;
 
+    fclose(f_in);
+    fclose(f_out);
+
     ffm_destroy_model(&model);
+    ffm_destroy_qmodel(&qmodel);
 
+    return 0;
 }
 
 int main(int argc, char **argv)
@@ -110,5 +319,5 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    predict(option.test_path, option.model_path, option.output_path);
+    return predict(option);
 }
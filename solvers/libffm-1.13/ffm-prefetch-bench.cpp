@@ -0,0 +1,176 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ffm.h"
+
+using namespace std;
+using namespace ffm;
+
+struct Option
+{
+    Option() : n(1<<20), m(16), l(200000), param(ffm_get_default_param()) {}
+    ffm_int n, m, l;
+    ffm_parameter param;
+};
+
+string bench_help()
+{
+    return string(
+"usage: ffm-prefetch-bench [options]\n"
+"\n"
+"Train on a synthetic problem whose model is larger than the last-level cache\n"
+"and report the time per iteration for a range of prefetch distances.\n"
+"\n"
+"options:\n"
+"-n <features>: set number of features (default 1048576)\n"
+"-m <fields>: set number of fields (default 16)\n"
+"-l <instances>: set number of instances (default 200000)\n"
+"-k <factor>: set number of latent factors (default 4)\n"
+"-t <iteration>: set number of timed iterations (default 2)\n"
+"-s <nr_threads>: set number of threads (default 1)\n");
+}
+
+Option parse_option(int argc, char **argv)
+{
+    vector<string> args;
+    for(int i = 0; i < argc; i++)
+        args.push_back(string(argv[i]));
+
+    Option opt;
+    opt.param.nr_iters = 2;
+    opt.param.quiet = true;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(i == argc-1)
+            throw invalid_argument(bench_help());
+
+        ffm_int value = atoi(args[i+1].c_str());
+        if(value <= 0)
+            throw invalid_argument("option values should be greater than zero");
+
+        if(args[i].compare("-n") == 0)
+            opt.n = value;
+        else if(args[i].compare("-m") == 0)
+            opt.m = value;
+        else if(args[i].compare("-l") == 0)
+            opt.l = value;
+        else if(args[i].compare("-k") == 0)
+            opt.param.k = value;
+        else if(args[i].compare("-t") == 0)
+            opt.param.nr_iters = value;
+        else if(args[i].compare("-s") == 0)
+            opt.param.nr_threads = value;
+        else
+            throw invalid_argument(bench_help());
+        i++;
+    }
+
+    return opt;
+}
+
+// One node per field with a uniformly random feature index, which is the
+// worst case for the cache: nearly every row access misses.
+ffm_problem make_problem(Option const &opt)
+{
+    ffm_problem prob;
+    prob.n = opt.n;
+    prob.m = opt.m;
+    prob.l = opt.l;
+    prob.X = new ffm_node[(ffm_long)opt.l*opt.m];
+    prob.P = new ffm_long[opt.l+1];
+    prob.Y = new ffm_float[opt.l];
+    prob.J = nullptr;
+    prob.F = nullptr;
+    prob.I = nullptr;
+    prob.V = nullptr;
+
+    default_random_engine generator;
+    uniform_int_distribution<ffm_int> feature(0, opt.n-1);
+    bernoulli_distribution label(0.25);
+
+    prob.P[0] = 0;
+    for(ffm_int i = 0; i < opt.l; i++)
+    {
+        for(ffm_int f = 0; f < opt.m; f++)
+        {
+            ffm_node &N = prob.X[(ffm_long)i*opt.m+f];
+            N.f = f;
+            N.j = feature(generator);
+            N.v = 1;
+        }
+        prob.P[i+1] = (ffm_long)(i+1)*opt.m;
+        prob.Y[i] = label(generator)? 1.0f : -1.0f;
+    }
+
+    return prob;
+}
+
+int main(int argc, char **argv)
+{
+    Option opt;
+    try
+    {
+        opt = parse_option(argc, argv);
+    }
+    catch(invalid_argument const &e)
+    {
+        cout << e.what() << endl;
+        return 1;
+    }
+
+    ffm_problem prob = make_problem(opt);
+
+    ffm_int k_aligned = (opt.param.k+3)/4*4;
+    cout << "model size = " << fixed << setprecision(1)
+         << (ffm_double)opt.n*opt.m*k_aligned*2*sizeof(ffm_float)/(1<<20) << " MB" << endl;
+
+    cout.width(9);
+    cout << "distance";
+    cout.width(13);
+    cout << "sec/iter";
+    cout << endl;
+
+    // ffm_train also initializes the model at random and normalizes the
+    // instances, which on a model of this size takes about as long as an
+    // iteration. A run of one iteration is timed as well and subtracted, so
+    // that only the iterations are compared.
+    auto time_train = [&] (ffm_int nr_iters)
+    {
+        ffm_parameter param = opt.param;
+        param.nr_iters = nr_iters;
+
+        auto start = chrono::high_resolution_clock::now();
+        ffm_model *model = ffm_train(&prob, param);
+        chrono::duration<ffm_double> elapsed = chrono::high_resolution_clock::now()-start;
+        ffm_destroy_model(&model);
+
+        return elapsed.count();
+    };
+
+    ffm_int distances[] = {0, 1, 2, 4, 8, 16, 32};
+    for(ffm_int distance : distances)
+    {
+        opt.param.prefetch_distance = distance;
+
+        ffm_double elapsed = time_train(1+opt.param.nr_iters)-time_train(1);
+
+        cout.width(9);
+        cout << distance;
+        cout.width(13);
+        cout << fixed << setprecision(3) << elapsed/opt.param.nr_iters;
+        cout << endl;
+    }
+
+    delete[] prob.X;
+    delete[] prob.P;
+    delete[] prob.Y;
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ffm.h"
+
+using namespace std;
+using namespace ffm;
+
+struct Option
+{
+    string model_path, qmodel_path, test_path;
+};
+
+string quantize_help()
+{
+    return string(
+"usage: ffm-quantize [options] model_file qmodel_file\n"
+"\n"
+"options:\n"
+"-p <path>: report logloss and prediction speed of both models on this set\n");
+}
+
+Option parse_option(int argc, char **argv)
+{
+    vector<string> args;
+    for(int i = 0; i < argc; i++)
+        args.push_back(string(argv[i]));
+
+    if(argc == 1)
+        throw invalid_argument(quantize_help());
+
+    Option opt;
+
+    int i = 1;
+    for(; i < argc; i++)
+    {
+        if(args[i].compare("-p") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after -p");
+            i++;
+            opt.test_path = args[i];
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(i != argc-2)
+        throw invalid_argument("cannot parse argument");
+
+    opt.model_path = args[i];
+    opt.qmodel_path = args[i+1];
+
+    return opt;
+}
+
+template<typename Model, typename Predict>
+void evaluate(ffm_problem *prob, Model *model, Predict predict, 
+    ffm_double &loss, ffm_double &speed)
+{
+    auto start = chrono::high_resolution_clock::now();
+
+    loss = 0;
+    for(ffm_int i = 0; i < prob->l; i++)
+    {
+        ffm_float y = prob->Y[i];
+        ffm_float y_bar = predict(&prob->X[prob->P[i]], &prob->X[prob->P[i+1]], model);
+        loss -= y==1? log(y_bar) : log(1-y_bar);
+    }
+    loss /= prob->l;
+
+    chrono::duration<ffm_double> elapsed = chrono::high_resolution_clock::now()-start;
+    speed = prob->l/max(elapsed.count(), 1e-9);
+}
+
+int main(int argc, char **argv)
+{
+    Option opt;
+    try
+    {
+        opt = parse_option(argc, argv);
+    }
+    catch(invalid_argument const &e)
+    {
+        cout << e.what() << endl;
+        return 1;
+    }
+
+    ffm_model *model = ffm_load_model(opt.model_path.c_str());
+    if(model == nullptr)
+    {
+        cerr << "cannot load " << opt.model_path << endl;
+        return 1;
+    }
+
+    if(model->mask != nullptr)
+    {
+        cerr << "cannot quantize a model with a pair mask" << endl;
+        ffm_destroy_model(&model);
+        return 1;
+    }
+
+    ffm_qmodel *qmodel = ffm_quantize_model(model);
+    if(qmodel == nullptr || ffm_save_qmodel(qmodel, opt.qmodel_path.c_str()) != 0)
+    {
+        cerr << "cannot write " << opt.qmodel_path << endl;
+        ffm_destroy_model(&model);
+        ffm_destroy_qmodel(&qmodel);
+        return 1;
+    }
+
+    ffm_long nr_rows = (ffm_long)model->n*model->m;
+    ffm_long fp32_size = nr_rows*model->k*sizeof(ffm_float);
+    ffm_long int8_size = nr_rows*((model->k+3)/4*4 + sizeof(ffm_float));
+    cout << "fp32 model: " << fp32_size << " bytes" << endl;
+    cout << "int8 model: " << int8_size << " bytes (" << fixed << setprecision(2) 
+         << (ffm_double)fp32_size/int8_size << "x smaller)" << endl;
+    if(model->k < 32)
+        cout << "note: with k < 32, an fp32 row fits in a cache line too, and int8 prediction is slower than fp32; "
+             << "the int8 model only saves memory" << endl;
+
+    int status = 0;
+    if(!opt.test_path.empty())
+    {
+        ffm_problem *prob = ffm_read_problem(opt.test_path.c_str());
+        if(prob == nullptr)
+        {
+            cerr << "cannot load " << opt.test_path << endl;
+            status = 1;
+        }
+        else
+        {
+            ffm_double loss, qloss, speed, qspeed;
+            evaluate(prob, model, ffm_predict, loss, speed);
+            evaluate(prob, qmodel, ffm_qpredict, qloss, qspeed);
+
+            cout << "fp32 logloss = " << fixed << setprecision(5) << loss 
+                 << " (" << setprecision(0) << speed << " predictions/s)" << endl;
+            cout << "int8 logloss = " << fixed << setprecision(5) << qloss 
+                 << " (" << setprecision(0) << qspeed << " predictions/s)" << endl;
+            cout << "delta = " << showpos << scientific << setprecision(3) 
+                 << qloss-loss << noshowpos << endl;
+
+            ffm_destroy_problem(&prob);
+        }
+    }
+
+    ffm_destroy_model(&model);
+    ffm_destroy_qmodel(&qmodel);
+
+    return status;
+}
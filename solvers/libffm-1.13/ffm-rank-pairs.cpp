@@ -0,0 +1,259 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ffm.h"
+
+using namespace std;
+using namespace ffm;
+
+struct Option
+{
+    Option() : nr_pruned(0) {}
+    string test_path, model_path, mask_path;
+    ffm_int nr_pruned;
+};
+
+string rank_pairs_help()
+{
+    return string(
+"usage: ffm-rank-pairs [options] test_file model_file\n"
+"\n"
+"Rank the pairs of fields by how much the logloss on test_file grows when the\n"
+"pair is left out of the model, least useful first.\n"
+"\n"
+"options:\n"
+"-n <count>: write a mask that leaves out the <count> least useful pairs (default 0)\n"
+"-o <path>: set path to the mask (default <model_file>.mask)\n");
+}
+
+Option parse_option(int argc, char **argv)
+{
+    vector<string> args;
+    for(int i = 0; i < argc; i++)
+        args.push_back(string(argv[i]));
+
+    if(argc == 1)
+        throw invalid_argument(rank_pairs_help());
+
+    Option opt;
+
+    int i = 1;
+    for(; i < argc; i++)
+    {
+        if(args[i].compare("-n") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify number of pairs after -n");
+            i++;
+            opt.nr_pruned = atoi(args[i].c_str());
+            if(opt.nr_pruned < 0)
+                throw invalid_argument("number of pairs should not be smaller than zero");
+        }
+        else if(args[i].compare("-o") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after -o");
+            i++;
+            opt.mask_path = args[i];
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if(i != argc-2)
+        throw invalid_argument("cannot parse argument");
+
+    opt.test_path = args[i];
+    opt.model_path = args[i+1];
+    if(opt.mask_path.empty())
+        opt.mask_path = opt.model_path + ".mask";
+
+    return opt;
+}
+
+struct PairScore
+{
+    ffm_int f1, f2;
+    ffm_double loss_increase;
+    ffm_double magnitude;
+};
+
+// For every pair of fields that occurs in prob, the mean increase of the
+// logloss when its terms are left out of each instance, and the mean absolute
+// value of those terms.
+vector<PairScore> score_pairs(ffm_problem *prob, ffm_model *model)
+{
+    ffm_int m = model->m;
+    vector<ffm_float> C((ffm_long)m*m, 0);
+    vector<ffm_double> loss_increase((ffm_long)m*m, 0), magnitude((ffm_long)m*m, 0);
+    vector<char> seen((ffm_long)m*m, 0), present(m, 0);
+    vector<ffm_int> fields;
+
+    for(ffm_int i = 0; i < prob->l; i++)
+    {
+        ffm_node *begin = &prob->X[prob->P[i]];
+        ffm_node *end = &prob->X[prob->P[i+1]];
+        ffm_float y = prob->Y[i];
+
+        ffm_float t = ffm_pair_contributions(begin, end, model, C.data());
+        ffm_double loss = log1p(exp(-y*t));
+
+        fields.clear();
+        for(ffm_node *N = begin; N != end; N++)
+        {
+            if(N->f < m && !present[N->f])
+            {
+                present[N->f] = 1;
+                fields.push_back(N->f);
+            }
+        }
+        sort(fields.begin(), fields.end());
+
+        for(ffm_int a = 0; a < (ffm_int)fields.size(); a++)
+        {
+            for(ffm_int b = a; b < (ffm_int)fields.size(); b++)
+            {
+                ffm_long idx = (ffm_long)fields[a]*m+fields[b];
+                if(model->mask != nullptr && !model->mask[idx])
+                    continue;
+
+                ffm_float c = C[idx];
+                seen[idx] = 1;
+                loss_increase[idx] += log1p(exp(-y*(t-c))) - loss;
+                magnitude[idx] += fabs(c);
+                C[idx] = 0;
+            }
+            present[fields[a]] = 0;
+        }
+    }
+
+    vector<PairScore> scores;
+    for(ffm_int f1 = 0; f1 < m; f1++)
+    {
+        for(ffm_int f2 = f1; f2 < m; f2++)
+        {
+            ffm_long idx = (ffm_long)f1*m+f2;
+            if(!seen[idx])
+                continue;
+
+            PairScore score;
+            score.f1 = f1;
+            score.f2 = f2;
+            score.loss_increase = loss_increase[idx]/prob->l;
+            score.magnitude = magnitude[idx]/prob->l;
+            scores.push_back(score);
+        }
+    }
+
+    stable_sort(scores.begin(), scores.end(), [] (PairScore const &a, PairScore const &b)
+    {
+        return a.loss_increase < b.loss_increase;
+    });
+
+    return scores;
+}
+
+// A mask that leaves out the first nr_pruned pairs of scores, and the pairs
+// that model leaves out already.
+int save_mask(vector<PairScore> const &scores, ffm_model *model, Option const &opt)
+{
+    ffm_int m = model->m;
+    vector<unsigned char> allowed((ffm_long)m*m, 1);
+    if(model->mask != nullptr)
+        copy(model->mask, model->mask+(ffm_long)m*m, allowed.begin());
+
+    ffm_int nr_pruned = min(opt.nr_pruned, (ffm_int)scores.size());
+    for(ffm_int p = 0; p < nr_pruned; p++)
+    {
+        allowed[(ffm_long)scores[p].f1*m+scores[p].f2] = 0;
+        allowed[(ffm_long)scores[p].f2*m+scores[p].f1] = 0;
+    }
+
+    ffm_pair_mask mask;
+    mask.m = m;
+    mask.allowed = allowed.data();
+    if(ffm_save_pair_mask(&mask, opt.mask_path.c_str()) != 0)
+    {
+        cerr << "cannot write " << opt.mask_path << endl;
+        return 1;
+    }
+
+    cout << "wrote a mask without " << nr_pruned << " more pairs to " << opt.mask_path << endl;
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    Option opt;
+    try
+    {
+        opt = parse_option(argc, argv);
+    }
+    catch(invalid_argument const &e)
+    {
+        cout << e.what() << endl;
+        return 1;
+    }
+
+    ffm_model *model = ffm_load_model(opt.model_path.c_str());
+    if(model == nullptr)
+    {
+        cerr << "cannot load " << opt.model_path << endl;
+        return 1;
+    }
+
+    ffm_problem *prob = ffm_read_problem(opt.test_path.c_str());
+    if(prob == nullptr)
+    {
+        cerr << "cannot load " << opt.test_path << endl;
+        ffm_destroy_model(&model);
+        return 1;
+    }
+
+    vector<PairScore> scores = score_pairs(prob, model);
+
+    cout.width(6);
+    cout << "rank";
+    cout.width(5);
+    cout << "f1";
+    cout.width(5);
+    cout << "f2";
+    cout.width(15);
+    cout << "d_logloss";
+    cout.width(13);
+    cout << "mean_|term|";
+    cout << endl;
+
+    for(ffm_int p = 0; p < (ffm_int)scores.size(); p++)
+    {
+        cout.width(6);
+        cout << p+1;
+        cout.width(5);
+        cout << scores[p].f1;
+        cout.width(5);
+        cout << scores[p].f2;
+        cout.width(15);
+        cout << showpos << scientific << setprecision(3) << scores[p].loss_increase;
+        cout.width(13);
+        cout << noshowpos << fixed << setprecision(5) << scores[p].magnitude;
+        cout << endl;
+    }
+
+    int status = 0;
+    if(opt.nr_pruned > 0)
+        status = save_mask(scores, model, opt);
+
+    ffm_destroy_problem(&prob);
+    ffm_destroy_model(&model);
+
+    return status;
+}
@@ -1,6 +1,7 @@
 #pragma GCC diagnostic ignored "-Wunused-result" 
 #include <algorithm>
 #include <cstring>
+#include <iomanip>
 #include <iostream>
 #include <stdexcept>
 #include <string>
@@ -22,23 +23,44 @@ string train_help()
 "-k <factor>: set number of latent factors (default 4)\n"
 "-t <iteration>: set number of iterations (default 15)\n"
 "-r <eta>: set learning rate (default 0.2)\n"
+"    (-l, -k and -r take comma-separated lists to train one model per combination in the same pass)\n"
 "-s <nr_threads>: set number of threads (default 1)\n"
 "-p <path>: set path to the validation set\n"
 "-v <fold>: set the number of folds for cross-validation\n"
 "--quiet: quiet model (no output)\n"
 "--no-norm: disable instance-wise normalization\n"
 "--no-rand: disable random update\n"
-"--on-disk: perform on-disk training (a temporary file <training_set_file>.bin will be generated)\n"
-"--auto-stop: stop at the iteration that achieves the best validation loss (must be used with -p)\n");
+"--on-disk: perform on-disk training (a file <training_set_file>.bin will be generated, or reused if up to date)\n"
+"--auto-stop: stop at the iteration that achieves the best validation loss (must be used with -p)\n"
+"--txt-model: save the model in text format instead of binary format\n"
+"--numa: pin threads and train one model replica per NUMA node\n"
+"--huge-pages: allocate the model and the training data on huge pages\n"
+"--block-shuffle <size>: shuffle blocks of <size> consecutive instances, and instances within each block\n"
+"--relayout: copy the training set into the shuffled order of each iteration in the background\n"
+"--remap: renumber features by descending frequency before training\n"
+"--deterministic: merge the threads' updates in a fixed order, giving the same model in every run with the same -s\n"
+"--workers <n>: train in <n> worker processes, each on a shard of the binary training set (Linux only)\n"
+"--servers <n>: keep the model in <n> parameter-server processes with --workers (default 1)\n"
+"--init <path>: continue training from the checkpoint <path> (-k and --no-norm are taken from the checkpoint)\n"
+"--checkpoint <path>: also save the model with its optimizer state to <path>, for use with --init\n"
+"--delta <path>: with --init, also save the rows of the model that training changed to <path>, for ffm-apply-delta\n"
+"--mask <path>: leave out the pairs of fields listed in <path> (see ffm-rank-pairs)\n"
+"--stream: train online on the instances of training_set_file (- for stdin, or a named pipe) as they arrive\n"
+"--features <n>: set number of features with --stream\n"
+"--fields <m>: set number of fields with --stream\n"
+"--snapshot-interval <sec>: save the model every <sec> seconds with --stream (default 60)\n"
+"--neg-sample <rate>: train on all positives and a fraction <rate> of the negatives, weighting each kept negative by 1/<rate>\n");
 }
 
 struct Option
 {
-    Option() : param(ffm_get_default_param()), nr_folds(1), do_cv(false), on_disk(false) {}
-    string tr_path, va_path, model_path;
+    Option() : param(ffm_get_default_param()), nr_folds(1), nr_workers(0), nr_servers(1), stream_n(0), stream_m(0), snapshot_interval(60), do_cv(false), on_disk(false), txt_model(false), huge_pages(false), remap(false), stream(false) {}
+    string tr_path, va_path, model_path, init_path, checkpoint_path, delta_path, mask_path;
     ffm_parameter param;
-    ffm_int nr_folds;
-    bool do_cv, on_disk;
+    vector<ffm_float> lambdas, etas;
+    vector<ffm_int> ks;
+    ffm_int nr_folds, nr_workers, nr_servers, stream_n, stream_m, snapshot_interval;
+    bool do_cv, on_disk, txt_model, huge_pages, remap, stream;
 };
 
 string basename(string path)
@@ -51,6 +73,22 @@ string basename(string path)
     return string(ptr);
 }
 
+// Split a comma-separated list of option values.
+vector<string> split_list(string const &list)
+{
+    vector<string> items;
+    size_t begin = 0;
+    while(true)
+    {
+        size_t end = list.find(',', begin);
+        items.push_back(list.substr(begin, end-begin));
+        if(end == string::npos)
+            break;
+        begin = end+1;
+    }
+    return items;
+}
+
 Option parse_option(int argc, char **argv)
 {
     vector<string> args;
@@ -79,27 +117,42 @@ Option parse_option(int argc, char **argv)
             if(i == argc-1)
                 throw invalid_argument("need to specify number of factors after -k");
             i++;
-            opt.param.k = atoi(args[i].c_str());
-            if(opt.param.k <= 0)
-                throw invalid_argument("number of factors should be greater than zero");
+            opt.ks.clear();
+            for(string const &item : split_list(args[i]))
+            {
+                opt.ks.push_back(atoi(item.c_str()));
+                if(opt.ks.back() <= 0)
+                    throw invalid_argument("number of factors should be greater than zero");
+            }
+            opt.param.k = opt.ks[0];
         }
         else if(args[i].compare("-r") == 0)
         {
             if(i == argc-1)
                 throw invalid_argument("need to specify eta after -r");
             i++;
-            opt.param.eta = atof(args[i].c_str());
-            if(opt.param.eta <= 0)
-                throw invalid_argument("learning rate should be greater than zero");
+            opt.etas.clear();
+            for(string const &item : split_list(args[i]))
+            {
+                opt.etas.push_back(atof(item.c_str()));
+                if(opt.etas.back() <= 0)
+                    throw invalid_argument("learning rate should be greater than zero");
+            }
+            opt.param.eta = opt.etas[0];
         }
         else if(args[i].compare("-l") == 0)
         {
             if(i == argc-1)
                 throw invalid_argument("need to specify lambda after -l");
             i++;
-            opt.param.lambda = atof(args[i].c_str());
-            if(opt.param.lambda < 0)
-                throw invalid_argument("regularization cost should not be smaller than zero");
+            opt.lambdas.clear();
+            for(string const &item : split_list(args[i]))
+            {
+                opt.lambdas.push_back(atof(item.c_str()));
+                if(opt.lambdas.back() < 0)
+                    throw invalid_argument("regularization cost should not be smaller than zero");
+            }
+            opt.param.lambda = opt.lambdas[0];
         }
         else if(args[i].compare("-s") == 0)
         {
@@ -147,6 +200,125 @@ Option parse_option(int argc, char **argv)
         {
             opt.param.auto_stop = true;
         }
+        else if(args[i].compare("--txt-model") == 0)
+        {
+            opt.txt_model = true;
+        }
+        else if(args[i].compare("--numa") == 0)
+        {
+            opt.param.numa = true;
+        }
+        else if(args[i].compare("--huge-pages") == 0)
+        {
+            opt.huge_pages = true;
+        }
+        else if(args[i].compare("--block-shuffle") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify block size after --block-shuffle");
+            i++;
+            opt.param.block_size = atoi(args[i].c_str());
+            if(opt.param.block_size <= 0)
+                throw invalid_argument("block size should be greater than zero");
+        }
+        else if(args[i].compare("--relayout") == 0)
+        {
+            opt.param.relayout = true;
+        }
+        else if(args[i].compare("--remap") == 0)
+        {
+            opt.remap = true;
+        }
+        else if(args[i].compare("--deterministic") == 0)
+        {
+            opt.param.deterministic = true;
+        }
+        else if(args[i].compare("--workers") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify number of workers after --workers");
+            i++;
+            opt.nr_workers = atoi(args[i].c_str());
+            if(opt.nr_workers <= 0)
+                throw invalid_argument("number of workers should be greater than zero");
+        }
+        else if(args[i].compare("--init") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --init");
+            i++;
+            opt.init_path = args[i];
+        }
+        else if(args[i].compare("--checkpoint") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --checkpoint");
+            i++;
+            opt.checkpoint_path = args[i];
+        }
+        else if(args[i].compare("--delta") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --delta");
+            i++;
+            opt.delta_path = args[i];
+        }
+        else if(args[i].compare("--mask") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify path after --mask");
+            i++;
+            opt.mask_path = args[i];
+        }
+        else if(args[i].compare("--stream") == 0)
+        {
+            opt.stream = true;
+        }
+        else if(args[i].compare("--features") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify number of features after --features");
+            i++;
+            opt.stream_n = atoi(args[i].c_str());
+            if(opt.stream_n <= 0)
+                throw invalid_argument("number of features should be greater than zero");
+        }
+        else if(args[i].compare("--fields") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify number of fields after --fields");
+            i++;
+            opt.stream_m = atoi(args[i].c_str());
+            if(opt.stream_m <= 0)
+                throw invalid_argument("number of fields should be greater than zero");
+        }
+        else if(args[i].compare("--snapshot-interval") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify number of seconds after --snapshot-interval");
+            i++;
+            opt.snapshot_interval = atoi(args[i].c_str());
+            if(opt.snapshot_interval <= 0)
+                throw invalid_argument("snapshot interval should be greater than zero");
+        }
+        else if(args[i].compare("--neg-sample") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify sampling rate after --neg-sample");
+            i++;
+            opt.param.neg_sample_rate = atof(args[i].c_str());
+            if(opt.param.neg_sample_rate <= 0 || opt.param.neg_sample_rate > 1)
+                throw invalid_argument("sampling rate should be greater than zero and at most one");
+        }
+        else if(args[i].compare("--servers") == 0)
+        {
+            if(i == argc-1)
+                throw invalid_argument("need to specify number of servers after --servers");
+            i++;
+            opt.nr_servers = atoi(args[i].c_str());
+            if(opt.nr_servers <= 0)
+                throw invalid_argument("number of servers should be greater than zero");
+        }
         else
         {
             break;
@@ -156,6 +328,13 @@ Option parse_option(int argc, char **argv)
     if(i != argc-2 && i != argc-1)
         throw invalid_argument("cannot parse command\n");
 
+    if(opt.lambdas.empty())
+        opt.lambdas.push_back(opt.param.lambda);
+    if(opt.etas.empty())
+        opt.etas.push_back(opt.param.eta);
+    if(opt.ks.empty())
+        opt.ks.push_back(opt.param.k);
+
     opt.tr_path = args[i];
     i++;
 
@@ -163,6 +342,10 @@ Option parse_option(int argc, char **argv)
     {
         opt.model_path = string(args[i]);
     }
+    else if(i == argc && opt.stream)
+    {
+        throw invalid_argument("need to specify model_file with --stream");
+    }
     else if(i == argc)
     {
         opt.model_path = basename(opt.tr_path) + ".model";
@@ -175,6 +358,130 @@ Option parse_option(int argc, char **argv)
     return opt;
 }
 
+ffm_int save_model(ffm_model *model, Option const &opt)
+{
+    if(opt.txt_model)
+        return ffm_save_txt_model(model, opt.model_path.c_str());
+    else
+        return ffm_save_model(model, opt.model_path.c_str());
+}
+
+bool is_sweep(Option const &opt)
+{
+    return opt.lambdas.size()*opt.etas.size()*opt.ks.size() > 1;
+}
+
+bool uses_checkpoint(Option const &opt)
+{
+    return !opt.init_path.empty() || !opt.checkpoint_path.empty() || !opt.delta_path.empty();
+}
+
+char const* optional_path(string const &path)
+{
+    return path.empty()? nullptr : path.c_str();
+}
+
+// The model trained with --init, --checkpoint and --delta; a nullptr if the
+// checkpoint to start from cannot be loaded.
+ffm_model* train_with_checkpoint(ffm_problem *tr, ffm_problem *va, Option const &opt)
+{
+    ffm_model *model = ffm_train_with_checkpoint(tr, va, optional_path(opt.init_path), 
+                                                 optional_path(opt.checkpoint_path), 
+                                                 optional_path(opt.delta_path), opt.param);
+    if(model == nullptr)
+        cerr << "cannot load " << opt.init_path << endl << flush;
+
+    return model;
+}
+
+// Train a model for every combination of the values of -l, -r and -k, and
+// save model i (counting from 1) to <model_file>.<i>.
+int sweep(ffm_problem *tr, ffm_problem *va, Option const &opt)
+{
+    vector<ffm_parameter> params;
+    for(ffm_float lambda : opt.lambdas)
+    {
+        for(ffm_float eta : opt.etas)
+        {
+            for(ffm_int k : opt.ks)
+            {
+                ffm_parameter param = opt.param;
+                param.lambda = lambda;
+                param.eta = eta;
+                param.k = k;
+                params.push_back(param);
+            }
+        }
+    }
+
+    ffm_int nr_models = (ffm_int)params.size();
+    vector<ffm_sweep_result> results(nr_models);
+    ffm_train_sweep(tr, va, params.data(), nr_models, results.data());
+
+    int status = 0;
+    vector<string> paths(nr_models);
+    for(ffm_int i = 0; i < nr_models; i++)
+    {
+        paths[i] = opt.model_path + "." + to_string(i+1);
+        Option model_opt = opt;
+        model_opt.model_path = paths[i];
+        if(save_model(results[i].model, model_opt) != 0)
+        {
+            cerr << "cannot save " << paths[i] << endl;
+            status = 1;
+        }
+        ffm_destroy_model(&results[i].model);
+    }
+
+    if(!opt.param.quiet)
+    {
+        cout << endl;
+        cout.width(6);
+        cout << "model";
+        cout.width(12);
+        cout << "lambda";
+        cout.width(8);
+        cout << "eta";
+        cout.width(5);
+        cout << "k";
+        cout.width(6);
+        cout << "iters";
+        cout.width(13);
+        cout << "tr_logloss";
+        if(va != nullptr)
+        {
+            cout.width(13);
+            cout << "va_logloss";
+        }
+        cout << "  model_file" << endl;
+
+        for(ffm_int i = 0; i < nr_models; i++)
+        {
+            cout.width(6);
+            cout << i+1;
+            cout.width(12);
+            cout << defaultfloat << params[i].lambda;
+            cout.width(8);
+            cout << params[i].eta;
+            cout.width(5);
+            cout << params[i].k;
+            cout.width(6);
+            cout << results[i].nr_iters;
+            cout.width(13);
+            cout << fixed << setprecision(5) << results[i].tr_loss;
+            if(va != nullptr)
+            {
+                cout.width(13);
+                cout << results[i].va_loss;
+            }
+            cout << "  " << paths[i] << endl;
+            cout << defaultfloat << setprecision(6);
+        }
+    }
+
+    return status;
+}
+
 int train(Option opt)
 {
     ffm_problem *tr = ffm_read_problem(opt.tr_path.c_str());
@@ -196,18 +503,49 @@ int train(Option opt)
         }
     }
 
+    // Keep the data in compact form when the fields fit in a byte; training
+    // gives the same results either way.
+    ffm_compact_problem(tr);
+    if(va != nullptr)
+        ffm_compact_problem(va);
+
+    if(opt.remap)
+    {
+        ffm_remap_problem(tr);
+        if(va != nullptr)
+            ffm_apply_remap(va, tr);
+    }
+
     int status = 0;
-    if(opt.do_cv)
+    if(is_sweep(opt))
+    {
+        status = sweep(tr, va, opt);
+    }
+    else if(opt.do_cv)
     {
         ffm_cross_validation(tr, opt.nr_folds, opt.param);
     }
     else
     {
-        ffm_model *model = ffm_train_with_validation(tr, va, opt.param);
+        ffm_model *model = nullptr;
+        if(uses_checkpoint(opt))
+            model = train_with_checkpoint(tr, va, opt);
+        else
+            model = ffm_train_with_validation(tr, va, opt.param);
 
-        status = ffm_save_model(model, opt.model_path.c_str());
+        if(model == nullptr)
+        {
+            status = 1;
+        }
+        else
+        {
+            if(opt.huge_pages && !opt.param.quiet)
+                ffm_report_huge_pages();
 
-        ffm_destroy_model(&model);
+            status = save_model(model, opt);
+
+            ffm_destroy_model(&model);
+        }
     }
 
     ffm_destroy_problem(&tr);
@@ -216,30 +554,98 @@ int train(Option opt)
     return status;
 }
 
+// The binary file to train on for path: path itself if it is a binary file
+// (e.g. made by ffm-convert), otherwise <basename>.bin, which is converted
+// from path unless it is an up-to-date conversion already. Returns an empty
+// string on failure.
+string get_bin_path(string const &path, bool quiet)
+{
+    if(ffm_is_bin_problem(path.c_str()))
+        return path;
+
+    string bin_path = basename(path) + ".bin";
+    if(ffm_bin_problem_up_to_date(path.c_str(), bin_path.c_str()))
+    {
+        if(!quiet)
+            cout << "reusing " << bin_path << endl;
+        return bin_path;
+    }
+
+    if(ffm_read_problem_to_disk(path.c_str(), bin_path.c_str()) != 0)
+    {
+        cerr << "cannot convert " << path << " to " << bin_path << endl << flush;
+        return "";
+    }
+
+    return bin_path;
+}
+
 int train_on_disk(Option opt)
 {
-    if(opt.param.random)
+    if(opt.param.numa)
     {
-        cout << "Random update is not allowed in disk-level training. Please use `--no-rand' to disable." << endl;
+        cout << "NUMA mode is not supported in disk-level training." << endl;
         return 1;
     }
 
-    if(opt.do_cv)
+    if(opt.param.relayout)
+    {
+        cout << "Relayout is not supported in disk-level training." << endl;
+        return 1;
+    }
+
+    if(opt.remap)
     {
-        cout << "Cross-validation is not yet implemented in disk-level training." << endl;
+        cout << "Feature remapping is not supported in disk-level training." << endl;
         return 1;
     }
 
-    string tr_bin_path = basename(opt.tr_path) + ".bin";
-    string va_bin_path = opt.va_path.empty()? "" : basename(opt.va_path) + ".bin";
+    if(opt.param.deterministic)
+    {
+        cout << "Deterministic mode is not supported in disk-level training." << endl;
+        return 1;
+    }
 
-    ffm_read_problem_to_disk(opt.tr_path.c_str(), tr_bin_path.c_str());
+    string tr_bin_path = get_bin_path(opt.tr_path, opt.param.quiet);
+    if(tr_bin_path.empty())
+        return 1;
+
+    if(opt.do_cv)
+    {
+        ffm_cross_validation_on_disk(tr_bin_path.c_str(), opt.nr_folds, opt.param);
+        return 0;
+    }
+
+    string va_bin_path;
     if(!opt.va_path.empty())
-        ffm_read_problem_to_disk(opt.va_path.c_str(), va_bin_path.c_str());
+    {
+        va_bin_path = get_bin_path(opt.va_path, opt.param.quiet);
+        if(va_bin_path.empty())
+            return 1;
+    }
 
-    ffm_model *model = ffm_train_with_validation_on_disk(tr_bin_path.c_str(), va_bin_path.c_str(), opt.param);
+    ffm_model *model = nullptr;
+    if(uses_checkpoint(opt))
+    {
+        model = ffm_train_with_checkpoint_on_disk(tr_bin_path.c_str(), va_bin_path.c_str(), 
+                                                  optional_path(opt.init_path), 
+                                                  optional_path(opt.checkpoint_path), 
+                                                  optional_path(opt.delta_path), opt.param);
+        if(model == nullptr)
+        {
+            cerr << "cannot load " << opt.init_path << endl << flush;
+            return 1;
+        }
+    }
+    else
+    {
+        model = ffm_train_with_validation_on_disk(tr_bin_path.c_str(), va_bin_path.c_str(), opt.param);
+    }
 
-    ffm_int status = ffm_save_model(model, opt.model_path.c_str());
+    if(opt.huge_pages && !opt.param.quiet)
+        ffm_report_huge_pages();
+
+    ffm_int status = save_model(model, opt);
     if(status != 0)
     {
         ffm_destroy_model(&model);
@@ -252,6 +658,137 @@ int train_on_disk(Option opt)
     return 0;
 }
 
+int train_distributed(Option opt)
+{
+    char const *unsupported = opt.on_disk? "Disk-level training" : 
+                              opt.do_cv? "Cross-validation" : 
+                              opt.param.numa? "NUMA mode" : 
+                              opt.param.relayout? "Relayout" : 
+                              opt.param.deterministic? "Deterministic mode" : 
+                              opt.remap? "Feature remapping" : 
+                              uses_checkpoint(opt)? "Checkpointing" : 
+                              opt.param.neg_sample_rate < 1? "Negative sampling" : 
+                              is_sweep(opt)? "A list of -l, -r or -k" : nullptr;
+    if(unsupported != nullptr)
+    {
+        cout << unsupported << " is not supported in distributed training." << endl;
+        return 1;
+    }
+
+    string tr_bin_path = get_bin_path(opt.tr_path, opt.param.quiet);
+    if(tr_bin_path.empty())
+        return 1;
+
+    string va_bin_path;
+    if(!opt.va_path.empty())
+    {
+        va_bin_path = get_bin_path(opt.va_path, opt.param.quiet);
+        if(va_bin_path.empty())
+            return 1;
+    }
+
+    ffm_model *model = ffm_train_distributed(tr_bin_path.c_str(), va_bin_path.c_str(), 
+                                             opt.nr_workers, opt.nr_servers, opt.param);
+    if(model == nullptr)
+    {
+        cerr << "distributed training failed" << endl;
+        return 1;
+    }
+
+    ffm_int status = save_model(model, opt);
+
+    ffm_destroy_model(&model);
+
+    return status != 0? 1 : 0;
+}
+
+int train_stream(Option opt)
+{
+    char const *unsupported = opt.on_disk? "Disk-level training" : 
+                              opt.do_cv? "Cross-validation" : 
+                              !opt.va_path.empty()? "Validation" : 
+                              opt.param.auto_stop? "Auto-stop" : 
+                              opt.param.numa? "NUMA mode" : 
+                              opt.param.relayout? "Relayout" : 
+                              opt.param.deterministic? "Deterministic mode" : 
+                              opt.remap? "Feature remapping" : 
+                              opt.txt_model? "Text model" : 
+                              opt.nr_workers > 0? "Distributed training" : 
+                              uses_checkpoint(opt)? "Checkpointing" : 
+                              is_sweep(opt)? "A list of -l, -r or -k" : 
+                              opt.param.neg_sample_rate < 1? "Negative sampling" : nullptr;
+    if(unsupported != nullptr)
+    {
+        cout << unsupported << " is not supported in streaming training." << endl;
+        return 1;
+    }
+
+    if(opt.stream_n == 0 || opt.stream_m == 0)
+    {
+        cout << "need to specify --features and --fields with --stream" << endl;
+        return 1;
+    }
+
+    ffm_int status = ffm_train_stream(opt.tr_path.c_str(), opt.model_path.c_str(), 
+                                      opt.stream_n, opt.stream_m, opt.snapshot_interval, opt.param);
+    if(status != 0)
+        cerr << "streaming training of " << opt.tr_path << " failed" << endl;
+
+    return status;
+}
+
+int dispatch(Option opt)
+{
+    if(opt.stream)
+        return train_stream(opt);
+
+    if(is_sweep(opt))
+    {
+        char const *unsupported = opt.on_disk? "Disk-level training" : 
+                                  opt.do_cv? "Cross-validation" : 
+                                  opt.param.numa? "NUMA mode" : 
+                                  opt.param.relayout? "Relayout" : 
+                                  opt.param.deterministic? "Deterministic mode" : 
+                                  uses_checkpoint(opt)? "Checkpointing" : 
+                                  opt.param.neg_sample_rate < 1? "Negative sampling" : nullptr;
+        if(unsupported != nullptr)
+        {
+            cout << unsupported << " is not supported with lists of -l, -r or -k." << endl;
+            return 1;
+        }
+    }
+
+    if(uses_checkpoint(opt))
+    {
+        char const *unsupported = opt.do_cv? "cross-validation" : 
+                                  opt.remap? "feature remapping" : nullptr;
+        if(unsupported != nullptr)
+        {
+            cout << "Checkpointing is not supported with " << unsupported << "." << endl;
+            return 1;
+        }
+
+        if(!opt.delta_path.empty() && opt.init_path.empty())
+        {
+            cout << "need to specify --init with --delta" << endl;
+            return 1;
+        }
+    }
+
+    if(opt.nr_workers > 0)
+    {
+        return train_distributed(opt);
+    }
+    else if(opt.on_disk)
+    {
+        return train_on_disk(opt);
+    }
+    else
+    {
+        return train(opt);
+    }
+}
+
 int main(int argc, char **argv)
 {
     Option opt;
@@ -265,12 +802,28 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    if(opt.on_disk)
+    ffm_set_huge_pages(opt.huge_pages);
+
+    if(opt.mask_path.empty())
+        return dispatch(opt);
+
+    if(opt.txt_model)
     {
-        return train_on_disk(opt);
+        cout << "Pair masks are not supported with text models." << endl;
+        return 1;
     }
-    else
+
+    ffm_pair_mask *mask = ffm_read_pair_mask(opt.mask_path.c_str());
+    if(mask == nullptr)
     {
-        return train(opt);
+        cerr << "cannot load " << opt.mask_path << endl << flush;
+        return 1;
     }
+    opt.param.pair_mask = mask;
+
+    int status = dispatch(opt);
+
+    ffm_destroy_pair_mask(&mask);
+
+    return status;
 }
@@ -1,9 +1,14 @@
 #pragma GCC diagnostic ignored "-Wunused-result" 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cerrno>
 #include <cmath>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <functional>
 #include <new>
 #include <memory>
 #include <random>
@@ -11,12 +16,38 @@
 #include <string>
 #include <cstring>
 #include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
 #include <pmmintrin.h>
+#if defined __SSSE3__
+#include <tmmintrin.h>
+#endif
+#if defined __AVX2__
+#include <immintrin.h>
+#endif
 
 #if defined USEOMP
 #include <omp.h>
 #endif
 
+#if defined __linux__
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "ffm.h"
 
 namespace ffm {
@@ -28,28 +59,69 @@ using namespace std;
 ffm_int const kALIGNByte = 16;
 ffm_int const kALIGN = kALIGNByte/sizeof(ffm_float);
 ffm_int const kCHUNK_SIZE = 10000000;
-ffm_int const kMaxLineSize = 100000;
+size_t const kTEXT_WINDOW_SIZE = 32<<20;
+
+char const kQMODEL_MAGIC[4] = {'F', 'F', 'M', 'Q'};
+ffm_int const kQMODEL_VERSION = 2;
+
+// Binary model: a fixed header followed by W, which starts at a page-aligned
+// offset so that the file can be mapped and used in place. Version 2 adds the
+// offset of the optional feature remapping J (0 if there is none), and
+// version 3 that of the optional m x m pair mask.
+char const kMODEL_MAGIC[4] = {'F', 'F', 'M', 'B'};
+ffm_int const kMODEL_VERSION = 3;
+ffm_long const kMODEL_PAYLOAD_OFFSET = 4096;
+
+// Checkpoint: a model in training layout, i.e. with the AdaGrad accumulators
+// and padded to k_aligned, so that training can continue from it. The header
+// is followed by W.
+char const kCHECKPOINT_MAGIC[4] = {'F', 'F', 'M', 'C'};
+ffm_int const kCHECKPOINT_VERSION = 1;
+
+// Delta: the rows (j, f) of a model that changed since a checkpoint. The
+// header is followed by the sorted row numbers j*m+f and then k weights per
+// row.
+char const kDELTA_MAGIC[4] = {'F', 'F', 'M', 'R'};
+ffm_int const kDELTA_VERSION = 1;
+
+inline ffm_int get_thread_num()
+{
+#if defined USEOMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
 
-inline ffm_float wTx(
-    ffm_node *begin,
-    ffm_node *end,
-    ffm_float r,
+inline ffm_int get_num_threads()
+{
+#if defined USEOMP
+    return omp_get_num_threads();
+#else
+    return 1;
+#endif
+}
+
+// The two rows w_{j1,f2} and w_{j2,f1} (each followed by its AdaGrad
+// accumulators) of a pair of nodes, and v1*v2.
+struct ffm_pair
+{
+    ffm_float *w1;
+    ffm_float *w2;
+    ffm_float v;
+};
+
+inline void get_pairs(
+    ffm_node const *begin, 
+    ffm_node const *end, 
     ffm_model &model, 
-    ffm_float kappa=0, 
-    ffm_float eta=0, 
-    ffm_float lambda=0, 
-    bool do_update=false)
+    vector<ffm_pair> &pairs)
 {
     ffm_long align0 = (ffm_long)model.k*2;
     ffm_long align1 = (ffm_long)model.m*align0;
 
-    __m128 XMMkappa = _mm_set1_ps(kappa);
-    __m128 XMMeta = _mm_set1_ps(eta);
-    __m128 XMMlambda = _mm_set1_ps(lambda);
-
-    __m128 XMMt = _mm_setzero_ps();
-
-    for(ffm_node *N1 = begin; N1 != end; N1++)
+    pairs.clear();
+    for(ffm_node const *N1 = begin; N1 != end; N1++)
     {
         ffm_int j1 = N1->j;
         ffm_int f1 = N1->f;
@@ -57,65 +129,211 @@ inline ffm_float wTx(
         if(j1 >= model.n || f1 >= model.m)
             continue;
 
-        for(ffm_node *N2 = N1+1; N2 != end; N2++)
+        unsigned char const *allowed = model.mask != nullptr? model.mask + (ffm_long)f1*model.m : nullptr;
+
+        for(ffm_node const *N2 = N1+1; N2 != end; N2++)
         {
             ffm_int j2 = N2->j;
             ffm_int f2 = N2->f;
             ffm_float v2 = N2->v;
-            if(j2 >= model.n || f2 >= model.m)
+            if(j2 >= model.n || f2 >= model.m || (allowed != nullptr && !allowed[f2]))
                 continue;
 
-            ffm_float *w1 = model.W + j1*align1 + f2*align0;
-            ffm_float *w2 = model.W + j2*align1 + f1*align0;
+            ffm_pair pair;
+            pair.w1 = model.W + j1*align1 + f2*align0;
+            pair.w2 = model.W + j2*align1 + f1*align0;
+            pair.v = v1*v2;
+            pairs.push_back(pair);
+        }
+    }
+}
 
-            __m128 XMMv = _mm_set1_ps(v1*v2*r);
+// The same for the nodes [begin, end) of a compact problem. With binary
+// features (V is a nullptr) every pair has v = 1 and no value is loaded.
+template<bool binary>
+inline void get_compact_pairs(
+    unsigned char const *F,
+    ffm_uint const *I,
+    ffm_float const *V,
+    ffm_long begin,
+    ffm_long end,
+    ffm_model &model, 
+    vector<ffm_pair> &pairs)
+{
+    ffm_long align0 = (ffm_long)model.k*2;
+    ffm_long align1 = (ffm_long)model.m*align0;
 
-            if(do_update)
-            {
-                __m128 XMMkappav = _mm_mul_ps(XMMkappa, XMMv);
+    pairs.clear();
+    for(ffm_long p1 = begin; p1 != end; p1++)
+    {
+        ffm_long j1 = I[p1];
+        ffm_int f1 = F[p1];
+        if(j1 >= model.n || f1 >= model.m)
+            continue;
 
-                ffm_float *wg1 = w1 + model.k;
-                ffm_float *wg2 = w2 + model.k;
-                for(ffm_int d = 0; d < model.k; d += 4)
-                {
-                    __m128 XMMw1 = _mm_load_ps(w1+d);
-                    __m128 XMMw2 = _mm_load_ps(w2+d);
+        unsigned char const *allowed = model.mask != nullptr? model.mask + (ffm_long)f1*model.m : nullptr;
 
-                    __m128 XMMwg1 = _mm_load_ps(wg1+d);
-                    __m128 XMMwg2 = _mm_load_ps(wg2+d);
+        for(ffm_long p2 = p1+1; p2 != end; p2++)
+        {
+            ffm_long j2 = I[p2];
+            ffm_int f2 = F[p2];
+            if(j2 >= model.n || f2 >= model.m || (allowed != nullptr && !allowed[f2]))
+                continue;
 
-                    __m128 XMMg1 = _mm_add_ps(
-                                   _mm_mul_ps(XMMlambda, XMMw1),
-                                   _mm_mul_ps(XMMkappav, XMMw2));
-                    __m128 XMMg2 = _mm_add_ps(
-                                   _mm_mul_ps(XMMlambda, XMMw2),
-                                   _mm_mul_ps(XMMkappav, XMMw1));
+            ffm_pair pair;
+            pair.w1 = model.W + j1*align1 + f2*align0;
+            pair.w2 = model.W + j2*align1 + f1*align0;
+            pair.v = binary? 1 : V[p1]*V[p2];
+            pairs.push_back(pair);
+        }
+    }
+}
 
-                    XMMwg1 = _mm_add_ps(XMMwg1, _mm_mul_ps(XMMg1, XMMg1));
-                    XMMwg2 = _mm_add_ps(XMMwg2, _mm_mul_ps(XMMg2, XMMg2));
+// A CSR block of instances, stored either as nodes X or, if X is a nullptr,
+// in the compact form of ffm_problem (F, I and V).
+struct Rows
+{
+    ffm_node const *X;
+    unsigned char const *F;
+    ffm_uint const *I;
+    ffm_float const *V;
+    ffm_long const *P;
+};
+
+inline Rows get_rows(ffm_problem const &prob)
+{
+    Rows rows = {prob.X, prob.F, prob.I, prob.V, prob.P};
+    return rows;
+}
 
-                    XMMw1 = _mm_sub_ps(XMMw1, _mm_mul_ps(XMMeta, 
-                            _mm_mul_ps(_mm_rsqrt_ps(XMMwg1), XMMg1)));
-                    XMMw2 = _mm_sub_ps(XMMw2, _mm_mul_ps(XMMeta, 
-                            _mm_mul_ps(_mm_rsqrt_ps(XMMwg2), XMMg2)));
+inline void get_pairs(Rows const &rows, ffm_int i, ffm_model &model, vector<ffm_pair> &pairs)
+{
+    if(rows.X != nullptr)
+        get_pairs(rows.X+rows.P[i], rows.X+rows.P[i+1], model, pairs);
+    else if(rows.V == nullptr)
+        get_compact_pairs<true>(rows.F, rows.I, rows.V, rows.P[i], rows.P[i+1], model, pairs);
+    else
+        get_compact_pairs<false>(rows.F, rows.I, rows.V, rows.P[i], rows.P[i+1], model, pairs);
+}
 
-                    _mm_store_ps(w1+d, XMMw1);
-                    _mm_store_ps(w2+d, XMMw2);
+// Append instance i of rows as nodes to X.
+inline void get_nodes(Rows const &rows, ffm_int i, vector<ffm_node> &X)
+{
+    if(rows.X != nullptr)
+    {
+        X.insert(X.end(), rows.X+rows.P[i], rows.X+rows.P[i+1]);
+        return;
+    }
 
-                    _mm_store_ps(wg1+d, XMMwg1);
-                    _mm_store_ps(wg2+d, XMMwg2);
-                }
+    for(ffm_long p = rows.P[i]; p < rows.P[i+1]; p++)
+    {
+        ffm_node N;
+        N.f = rows.F[p];
+        N.j = rows.I[p];
+        N.v = rows.V != nullptr? rows.V[p] : 1;
+        X.push_back(N);
+    }
+}
+
+inline void prefetch_pair(ffm_pair const &pair, ffm_int nr_lines)
+{
+    for(ffm_int i = 0; i < nr_lines; i++)
+    {
+        _mm_prefetch((char const*)pair.w1 + i*64, _MM_HINT_T0);
+        _mm_prefetch((char const*)pair.w2 + i*64, _MM_HINT_T0);
+    }
+}
+
+// All row addresses of an instance are known before the first one is loaded,
+// so while pair p is processed the rows of pair p+distance are prefetched.
+// When `next' is given, prefetching runs on into the pairs of the next
+// instance, hiding its first misses behind the current update.
+inline ffm_float wTx(
+    vector<ffm_pair> const &pairs,
+    ffm_float r,
+    ffm_model &model, 
+    ffm_float kappa=0, 
+    ffm_float eta=0, 
+    ffm_float lambda=0, 
+    bool do_update=false,
+    ffm_int distance=0,
+    vector<ffm_pair> const *next=nullptr)
+{
+    ffm_int nr_pairs = (ffm_int)pairs.size();
+    ffm_int nr_next = next != nullptr? (ffm_int)next->size() : 0;
+    ffm_int nr_lines = (model.k*2*sizeof(ffm_float)+63)/64;
+
+    __m128 XMMkappa = _mm_set1_ps(kappa);
+    __m128 XMMeta = _mm_set1_ps(eta);
+    __m128 XMMlambda = _mm_set1_ps(lambda);
+
+    __m128 XMMt = _mm_setzero_ps();
+
+    if(distance > 0)
+        for(ffm_int p = 0; p < min(distance, nr_pairs); p++)
+            prefetch_pair(pairs[p], nr_lines);
+
+    for(ffm_int p = 0; p < nr_pairs; p++)
+    {
+        if(distance > 0)
+        {
+            ffm_int q = p+distance;
+            if(q < nr_pairs)
+                prefetch_pair(pairs[q], nr_lines);
+            else if(q-nr_pairs < nr_next)
+                prefetch_pair((*next)[q-nr_pairs], nr_lines);
+        }
+
+        ffm_float *w1 = pairs[p].w1;
+        ffm_float *w2 = pairs[p].w2;
+
+        __m128 XMMv = _mm_set1_ps(pairs[p].v*r);
+
+        if(do_update)
+        {
+            __m128 XMMkappav = _mm_mul_ps(XMMkappa, XMMv);
+
+            ffm_float *wg1 = w1 + model.k;
+            ffm_float *wg2 = w2 + model.k;
+            for(ffm_int d = 0; d < model.k; d += 4)
+            {
+                __m128 XMMw1 = _mm_load_ps(w1+d);
+                __m128 XMMw2 = _mm_load_ps(w2+d);
+
+                __m128 XMMwg1 = _mm_load_ps(wg1+d);
+                __m128 XMMwg2 = _mm_load_ps(wg2+d);
+
+                __m128 XMMg1 = _mm_add_ps(
+                               _mm_mul_ps(XMMlambda, XMMw1),
+                               _mm_mul_ps(XMMkappav, XMMw2));
+                __m128 XMMg2 = _mm_add_ps(
+                               _mm_mul_ps(XMMlambda, XMMw2),
+                               _mm_mul_ps(XMMkappav, XMMw1));
+
+                XMMwg1 = _mm_add_ps(XMMwg1, _mm_mul_ps(XMMg1, XMMg1));
+                XMMwg2 = _mm_add_ps(XMMwg2, _mm_mul_ps(XMMg2, XMMg2));
+
+                XMMw1 = _mm_sub_ps(XMMw1, _mm_mul_ps(XMMeta, 
+                        _mm_mul_ps(_mm_rsqrt_ps(XMMwg1), XMMg1)));
+                XMMw2 = _mm_sub_ps(XMMw2, _mm_mul_ps(XMMeta, 
+                        _mm_mul_ps(_mm_rsqrt_ps(XMMwg2), XMMg2)));
+
+                _mm_store_ps(w1+d, XMMw1);
+                _mm_store_ps(w2+d, XMMw2);
+
+                _mm_store_ps(wg1+d, XMMwg1);
+                _mm_store_ps(wg2+d, XMMwg2);
             }
-            else
+        }
+        else
+        {
+            for(ffm_int d = 0; d < model.k; d += 4)
             {
-                for(ffm_int d = 0; d < model.k; d += 4)
-                {
-                    __m128  XMMw1 = _mm_load_ps(w1+d);
-                    __m128  XMMw2 = _mm_load_ps(w2+d);
+                __m128  XMMw1 = _mm_load_ps(w1+d);
+                __m128  XMMw2 = _mm_load_ps(w2+d);
 
-                    XMMt = _mm_add_ps(XMMt, 
-                           _mm_mul_ps(_mm_mul_ps(XMMw1, XMMw2), XMMv));
-                }
+                XMMt = _mm_add_ps(XMMt, 
+                       _mm_mul_ps(_mm_mul_ps(XMMw1, XMMw2), XMMv));
             }
         }
     }
@@ -131,783 +349,5206 @@ inline ffm_float wTx(
     return t;
 }
 
-ffm_float* malloc_aligned_float(ffm_long size)
+void* malloc_aligned(ffm_long size)
 {
     void *ptr;
 
 #ifdef _WIN32
-    ptr = _aligned_malloc(size*sizeof(ffm_float), kALIGNByte);
+    ptr = _aligned_malloc(size, kALIGNByte);
     if(ptr == nullptr)
         throw bad_alloc();
 #else
-    int status = posix_memalign(&ptr, kALIGNByte, size*sizeof(ffm_float));
+    int status = posix_memalign(&ptr, kALIGNByte, size);
     if(status != 0)
         throw bad_alloc();
 #endif
     
-    return (ffm_float*)ptr;
+    return ptr;
 }
 
-ffm_model* init_model(ffm_int n, ffm_int m, ffm_parameter param)
+ffm_float* malloc_aligned_float(ffm_long size)
 {
-    ffm_int k_aligned = (ffm_int)ceil((ffm_double)param.k/kALIGN)*kALIGN;
+    return (ffm_float*)malloc_aligned(size*sizeof(ffm_float));
+}
 
-    ffm_model *model = new ffm_model;
-    model->n = n;
-    model->k = k_aligned;
-    model->m = m;
-    model->W = nullptr;
-    model->normalization = param.normalization;
-    
-    try
-    {
-        model->W = malloc_aligned_float((ffm_long)n*m*k_aligned*2);
-    }
-    catch(bad_alloc const &e)
-    {
-        ffm_destroy_model(&model);
-        throw;
-    }
+// Memory that was not obtained from malloc_aligned (a mapped model file or a
+// huge-page allocation) is recorded here so that free_aligned knows how to
+// release it.
+enum MappingKind { kFILE, kHUGETLB, kTHP };
 
-    ffm_float coef = 1.0f/sqrt(param.k);
-    ffm_float *w = model->W;
+struct Mapping
+{
+    void *base;
+    size_t size;
+    MappingKind kind;
+    size_t page_size;
+    char const *name;
+};
+
+mutex mappings_mtx;
+unordered_map<void const*, Mapping> mappings;
+
+void register_mapping(
+    void const *ptr, 
+    void *base, 
+    size_t size, 
+    MappingKind kind=kFILE, 
+    size_t page_size=0, 
+    char const *name="")
+{
+    lock_guard<mutex> lock(mappings_mtx);
+    mappings[ptr] = Mapping{base, size, kind, page_size, name};
+}
 
-    default_random_engine generator;
-    uniform_real_distribution<ffm_float> distribution(0.0, 1.0);
+void free_aligned(void *ptr)
+{
+    if(ptr == nullptr)
+        return;
 
-    for(ffm_int j = 0; j < model->n; j++)
+#ifndef _WIN32
     {
-        for(ffm_int f = 0; f < model->m; f++)
+        lock_guard<mutex> lock(mappings_mtx);
+        auto it = mappings.find(ptr);
+        if(it != mappings.end())
         {
-            for(ffm_int d = 0; d < param.k; d++, w++)
-                *w = coef*distribution(generator);
-            for(ffm_int d = param.k; d < k_aligned; d++, w++)
-                *w = 0;
-            for(ffm_int d = k_aligned; d < 2*k_aligned; d++, w++)
-                *w = 1;
+            munmap(it->second.base, it->second.size);
+            mappings.erase(it);
+            return;
         }
     }
+#endif
 
-    return model;
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
 }
 
-void shrink_model(ffm_model &model, ffm_int k_new)
+bool use_huge_pages = false;
+
+ffm_long const kHugePageSize = 2<<20;
+
+// Allocate `size' bytes for a large array that is accessed randomly (W, or
+// the instances of a problem), preferably on huge pages to save TLB misses.
+// If huge pages are enabled we try, in order, 1GB hugetlb pages (for arrays of
+// at least 1GB), 2MB hugetlb pages, and a 2MB-aligned anonymous mapping with
+// madvise(MADV_HUGEPAGE) for transparent huge pages. Otherwise, or if all of
+// these fail, this is malloc_aligned. Release with free_aligned.
+void* malloc_huge(ffm_long size, char const *name)
 {
-    for(ffm_int j = 0; j < model.n; j++)
+#if defined __linux__
+    if(!use_huge_pages || size < kHugePageSize)
+        return malloc_aligned(size);
+
+    size_t page_sizes[] = {(size_t)1<<30, (size_t)kHugePageSize};
+    for(size_t page_size : page_sizes)
     {
-        for(ffm_int f = 0; f < model.m; f++)
+        if((size_t)size < page_size)
+            continue;
+
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+#if defined MAP_HUGE_1GB && defined MAP_HUGE_2MB
+        flags |= page_size == ((size_t)1<<30)? MAP_HUGE_1GB : MAP_HUGE_2MB;
+#else
+        if(page_size != (size_t)kHugePageSize)
+            continue;
+#endif
+        size_t len = (size+page_size-1)/page_size*page_size;
+        void *ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if(ptr != MAP_FAILED)
         {
-            ffm_float *src = model.W + ((ffm_long)j*model.m+f)*model.k*2;
-            ffm_float *dst = model.W + ((ffm_long)j*model.m+f)*k_new;
-            copy(src, src+k_new, dst);
+            register_mapping(ptr, ptr, len, kHUGETLB, page_size, name);
+            return ptr;
         }
     }
 
-    model.k = k_new;
+    size_t len = (size+kHugePageSize-1)/kHugePageSize*kHugePageSize;
+    void *base = mmap(nullptr, len+kHugePageSize, PROT_READ | PROT_WRITE, 
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED)
+        return malloc_aligned(size);
+
+    char *ptr = (char*)(((uintptr_t)base+kHugePageSize-1)/kHugePageSize*kHugePageSize);
+    if(ptr != base)
+        munmap(base, ptr-(char*)base);
+    if(ptr+len != (char*)base+len+kHugePageSize)
+        munmap(ptr+len, (char*)base+len+kHugePageSize-(ptr+len));
+#if defined MADV_HUGEPAGE
+    madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+    register_mapping(ptr, ptr, len, kTHP, kHugePageSize, name);
+    return ptr;
+#else
+    (void)name;
+    return malloc_aligned(size);
+#endif
 }
 
-vector<ffm_float> normalize(ffm_problem &prob)
+ffm_float* malloc_huge_float(ffm_long size, char const *name)
 {
-    vector<ffm_float> R(prob.l);
-#if defined USEOMP
-#pragma omp parallel for schedule(static)
-#endif
-    for(ffm_int i = 0; i < prob.l; i++)
+    return (ffm_float*)malloc_huge(size*sizeof(ffm_float), name);
+}
+
+#if defined __linux__
+// Size in bytes of the transparent huge pages backing [begin, begin+size),
+// according to /proc/self/smaps.
+size_t get_thp_size(void *begin, size_t size)
+{
+    ifstream f_in("/proc/self/smaps");
+    uintptr_t lo = (uintptr_t)begin, hi = lo+size;
+
+    size_t total = 0;
+    bool inside = false;
+    string line;
+    while(getline(f_in, line))
     {
-        ffm_float norm = 0;
-        for(ffm_long p = prob.P[i]; p < prob.P[i+1]; p++)
-            norm += prob.X[p].v*prob.X[p].v;
-        R[i] = 1/norm;
+        uintptr_t start, end;
+        if(sscanf(line.c_str(), "%lx-%lx ", (unsigned long*)&start, (unsigned long*)&end) == 2 &&
+           line.find(':') > line.find(' '))
+        {
+            inside = start < hi && end > lo;
+            continue;
+        }
+
+        size_t kb;
+        if(inside && sscanf(line.c_str(), "AnonHugePages: %zu kB", &kb) == 1)
+            total += kb<<10;
     }
 
-    return R;
+    return total;
 }
-
-shared_ptr<ffm_model> train(
-    ffm_problem *tr, 
-    vector<ffm_int> &order, 
-    ffm_parameter param, 
-    ffm_problem *va=nullptr)
-{
-#if defined USEOMP
-    ffm_int old_nr_threads = omp_get_num_threads();
-    omp_set_num_threads(param.nr_threads);
 #endif
 
-    shared_ptr<ffm_model> model = 
-        shared_ptr<ffm_model>(init_model(tr->n, tr->m, param),
-            [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+// Each quantized row holds k int8 values padded to a multiple of 4 bytes, so
+// that the dot-product kernel below can always consume whole 32-bit groups.
+ffm_int const kQALIGN = 4;
 
-    vector<ffm_float> R_tr, R_va;
-    if(param.normalization)
-    {
-        R_tr = normalize(*tr);
-        if(va != nullptr)
-            R_va = normalize(*va);
-    }
-    else
-    {
-        R_tr = vector<ffm_float>(tr->l, 1);
-        if(va != nullptr)
-            R_va = vector<ffm_float>(va->l, 1);
-    }
+inline ffm_int get_qk(ffm_int k)
+{
+    return (k+kQALIGN-1)/kQALIGN*kQALIGN;
+}
 
-    bool auto_stop = param.auto_stop && va != nullptr && va->l != 0;
+#if defined __SSSE3__
+// Signed int8 x int8 products, summed into four int32 lanes. maddubs wants an
+// unsigned left operand, so the sign of `a' is moved onto `b' first. Values
+// are clamped to [-127, 127] at quantization time, which keeps the pairwise
+// int16 sums of maddubs from saturating.
+inline __m128i qdot_step(__m128i a, __m128i b)
+{
+    __m128i XMMa = _mm_abs_epi8(a);
+    __m128i XMMb = _mm_sign_epi8(b, a);
+#if defined __AVX512VNNI__ && defined __AVX512VL__
+    return _mm_dpbusd_epi32(_mm_setzero_si128(), XMMa, XMMb);
+#else
+    return _mm_madd_epi16(_mm_maddubs_epi16(XMMa, XMMb), _mm_set1_epi16(1));
+#endif
+}
+#endif
 
-    ffm_int k_aligned = (ffm_int)ceil((ffm_double)param.k/kALIGN)*kALIGN;
-    ffm_long w_size = (ffm_long)model->n * model->m * k_aligned * 2;
-    vector<ffm_float> prev_W;
-    if(auto_stop)
-        prev_W.assign(w_size, 0);
-    ffm_double best_va_loss = numeric_limits<ffm_double>::max();
+inline ffm_int qdot(signed char const *q1, signed char const *q2, ffm_int qk)
+{
+#if defined __SSSE3__
+    ffm_int d = 0;
+    __m128i XMMt = _mm_setzero_si128();
 
-    if(!param.quiet)
+#if defined __AVX2__
+    if(qk >= 32)
     {
-        if(param.auto_stop && (va == nullptr || va->l == 0))
-            cerr << "warning: ignoring auto-stop because there is no validation set" << endl;
-
-        cout.width(4);
-        cout << "iter";
-        cout.width(13);
-        cout << "tr_logloss";
-        if(va != nullptr && va->l != 0)
+        __m256i YMMt = _mm256_setzero_si256();
+        __m256i YMMones = _mm256_set1_epi16(1);
+        for(; d+32 <= qk; d += 32)
         {
-            cout.width(13);
-            cout << "va_logloss";
+            __m256i YMMq1 = _mm256_loadu_si256((__m256i const*)(q1+d));
+            __m256i YMMq2 = _mm256_loadu_si256((__m256i const*)(q2+d));
+            YMMt = _mm256_add_epi32(YMMt, _mm256_madd_epi16(
+                   _mm256_maddubs_epi16(_mm256_abs_epi8(YMMq1), 
+                                        _mm256_sign_epi8(YMMq2, YMMq1)),
+                   YMMones));
         }
-        cout << endl;
+        XMMt = _mm_add_epi32(_mm256_castsi256_si128(YMMt), 
+                             _mm256_extracti128_si256(YMMt, 1));
     }
-
-    for(ffm_int iter = 1; iter <= param.nr_iters; iter++)
-    {
-        ffm_double tr_loss = 0;
-        if(param.random)
-            random_shuffle(order.begin(), order.end());
-#if defined USEOMP
-#pragma omp parallel for schedule(static) reduction(+: tr_loss)
 #endif
-        for(ffm_int ii = 0; ii < tr->l; ii++)
-        {
-            ffm_int i = order[ii];
 
-            ffm_float y = tr->Y[i];
-            
-            ffm_node *begin = &tr->X[tr->P[i]];
+    for(; d+16 <= qk; d += 16)
+        XMMt = _mm_add_epi32(XMMt, qdot_step(
+               _mm_loadu_si128((__m128i const*)(q1+d)),
+               _mm_loadu_si128((__m128i const*)(q2+d))));
 
-            ffm_node *end = &tr->X[tr->P[i+1]];
+    for(; d < qk; d += kQALIGN)
+    {
+        int a, b;
+        memcpy(&a, q1+d, sizeof(int));
+        memcpy(&b, q2+d, sizeof(int));
+        XMMt = _mm_add_epi32(XMMt, qdot_step(
+               _mm_cvtsi32_si128(a), _mm_cvtsi32_si128(b)));
+    }
 
-            ffm_float r = R_tr[i];
+    XMMt = _mm_hadd_epi32(XMMt, XMMt);
+    XMMt = _mm_hadd_epi32(XMMt, XMMt);
+    return _mm_cvtsi128_si32(XMMt);
+#else
+    ffm_int t = 0;
+    for(ffm_int d = 0; d < qk; d++)
+        t += (ffm_int)q1[d]*q2[d];
+    return t;
+#endif
+}
 
-            ffm_float t = wTx(begin, end, r, *model);
+// Prediction-time counterpart of wTx. A loaded model is no longer padded, so
+// rows have stride k and are not aligned; whole groups of 8 (AVX) or 4 (SSE)
+// are vectorized and the remainder is done in scalar.
+inline ffm_float wTx_predict(
+    ffm_node *begin, 
+    ffm_node *end, 
+    ffm_float r, 
+    ffm_model const &model)
+{
+    ffm_long align0 = (ffm_long)model.k;
+    ffm_long align1 = (ffm_long)model.m*align0;
+    ffm_int k4 = model.k/4*4;
 
-            ffm_float expnyt = exp(-y*t);
+    __m128 XMMt = _mm_setzero_ps();
+#if defined __AVX__
+    ffm_int k8 = model.k/8*8;
+    __m256 YMMt = _mm256_setzero_ps();
+#endif
+    ffm_float t = 0;
 
-            tr_loss += log(1+expnyt);
-               
-            ffm_float kappa = -y*expnyt/(1+expnyt);
+    for(ffm_node *N1 = begin; N1 != end; N1++)
+    {
+        ffm_int j1 = N1->j;
+        ffm_int f1 = N1->f;
+        ffm_float v1 = N1->v;
+        if(j1 >= model.n || f1 >= model.m)
+            continue;
 
-            wTx(begin, end, r, *model, kappa, param.eta, param.lambda, true);
-        }
+        unsigned char const *allowed = model.mask != nullptr? model.mask + (ffm_long)f1*model.m : nullptr;
 
-        if(!param.quiet)
+        for(ffm_node *N2 = N1+1; N2 != end; N2++)
         {
-            tr_loss /= tr->l;
+            ffm_int j2 = N2->j;
+            ffm_int f2 = N2->f;
+            ffm_float v2 = N2->v;
+            if(j2 >= model.n || f2 >= model.m || (allowed != nullptr && !allowed[f2]))
+                continue;
 
-            cout.width(4);
-            cout << iter;
-            cout.width(13);
-            cout << fixed << setprecision(5) << tr_loss;
-            if(va != nullptr && va->l != 0)
-            {
-                ffm_double va_loss = 0;
-#if defined USEOMP
-#pragma omp parallel for schedule(static) reduction(+:va_loss)
-#endif
-                for(ffm_int i = 0; i < va->l; i++)
-                {
-                    ffm_float y = va->Y[i];
+            ffm_float *w1 = model.W + j1*align1 + f2*align0;
+            ffm_float *w2 = model.W + j2*align1 + f1*align0;
 
-                    ffm_node *begin = &va->X[va->P[i]];
+            ffm_float v = v1*v2*r;
 
-                    ffm_node *end = &va->X[va->P[i+1]];
+            ffm_int d = 0;
+#if defined __AVX__
+            __m256 YMMv = _mm256_set1_ps(v);
+            for(; d < k8; d += 8)
+                YMMt = _mm256_add_ps(YMMt, _mm256_mul_ps(
+                       _mm256_mul_ps(_mm256_loadu_ps(w1+d), _mm256_loadu_ps(w2+d)), YMMv));
+#endif
+            __m128 XMMv = _mm_set1_ps(v);
+            for(; d < k4; d += 4)
+                XMMt = _mm_add_ps(XMMt, _mm_mul_ps(
+                       _mm_mul_ps(_mm_loadu_ps(w1+d), _mm_loadu_ps(w2+d)), XMMv));
+            for(; d < model.k; d++)
+                t += w1[d]*w2[d]*v;
+        }
+    }
 
-                    ffm_float r = R_va[i];
+#if defined __AVX__
+    XMMt = _mm_add_ps(XMMt, _mm_add_ps(_mm256_castps256_ps128(YMMt), 
+                                       _mm256_extractf128_ps(YMMt, 1)));
+#endif
+    XMMt = _mm_hadd_ps(XMMt, XMMt);
+    XMMt = _mm_hadd_ps(XMMt, XMMt);
+    ffm_float t_simd;
+    _mm_store_ss(&t_simd, XMMt);
 
-                    ffm_float t = wTx(begin, end, r, *model);
-                    
-                    ffm_float expnyt = exp(-y*t);
+    return t+t_simd;
+}
 
-                    va_loss += log(1+expnyt);
-                }
-                va_loss /= va->l;
+// Point [begin, end) to a copy of the instance with feature indices mapped
+// by J (if J is not a nullptr). Indices outside of J are kept; the kernels
+// skip them anyway.
+inline void remap_nodes(
+    ffm_node *&begin, 
+    ffm_node *&end, 
+    ffm_int const *J, 
+    ffm_int n, 
+    vector<ffm_node> &buffer)
+{
+    if(J == nullptr)
+        return;
 
-                cout.width(13);
-                cout << fixed << setprecision(5) << va_loss;
+    buffer.assign(begin, end);
+    for(ffm_node &N : buffer)
+        if(N.j >= 0 && N.j < n)
+            N.j = J[N.j];
 
-                if(auto_stop)
-                {
-                    if(va_loss > best_va_loss)
-                    {
-                        memcpy(model->W, prev_W.data(), w_size*sizeof(ffm_float));
-                        cout << endl << "Auto-stop. Use model at " << iter-1 << "th iteration." << endl;
-                        break;
-                    }
-                    else
-                    {
-                        memcpy(prev_W.data(), model->W, w_size*sizeof(ffm_float));
-                        best_va_loss = va_loss; 
-                    }
-                }
-            }
-            cout << endl;
-        }
-    }
+    begin = buffer.data();
+    end = buffer.data()+buffer.size();
+}
 
-    shrink_model(*model, param.k);
+inline ffm_float get_scale(ffm_node *begin, ffm_node *end)
+{
+    ffm_float r = 0;
+    for(ffm_node *N = begin; N != end; N++)
+        r += N->v*N->v; 
+    return 1/r;
+}
 
-#if defined USEOMP
-    omp_set_num_threads(old_nr_threads);
-#endif
+// exp() of four floats, following the Cephes single-precision routine:
+// exp(x) = 2^n*exp(g) with n = round(x/ln2) and a degree-5 polynomial for
+// exp(g), |g| <= ln2/2. The relative error is within a few ulps.
+inline __m128 exp_ps(__m128 x)
+{
+    x = _mm_min_ps(x, _mm_set1_ps(88.3762626647949f));
+    x = _mm_max_ps(x, _mm_set1_ps(-88.3762626647949f));
+
+    __m128 fx = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), 
+                           _mm_set1_ps(0.5f));
+    __m128 tmp = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+    __m128 mask = _mm_and_ps(_mm_cmpgt_ps(tmp, fx), _mm_set1_ps(1.0f));
+    fx = _mm_sub_ps(tmp, mask);
+
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(0.693359375f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(fx, _mm_set1_ps(-2.12194440e-4f)));
+    __m128 z = _mm_mul_ps(x, x);
+
+    __m128 y = _mm_set1_ps(1.9875691500E-4f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507E-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073E-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894E-2f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, z), _mm_add_ps(x, _mm_set1_ps(1.0f)));
+
+    __m128i n = _mm_add_epi32(_mm_cvttps_epi32(fx), _mm_set1_epi32(127));
+    __m128 pow2n = _mm_castsi128_ps(_mm_slli_epi32(n, 23));
+
+    return _mm_mul_ps(y, pow2n);
+}
 
-    return model;
+// t[i] <- 1/(1+exp(-t[i])) for i in [0, l)
+void sigmoid(ffm_float *t, ffm_int l)
+{
+    __m128 XMMone = _mm_set1_ps(1.0f);
+    __m128 XMMzero = _mm_setzero_ps();
+
+    ffm_int i = 0;
+    for(; i+4 <= l; i += 4)
+    {
+        __m128 XMMt = _mm_loadu_ps(t+i);
+        __m128 XMMe = exp_ps(_mm_sub_ps(XMMzero, XMMt));
+        _mm_storeu_ps(t+i, _mm_div_ps(XMMone, _mm_add_ps(XMMone, XMMe)));
+    }
+    for(; i < l; i++)
+        t[i] = 1/(1+exp(-t[i]));
 }
 
-// TODO: This function will be merged with train().
-shared_ptr<ffm_model> train_on_disk(
-    string tr_path,
-    string va_path,
-    ffm_parameter param)
+// The m x m mask of a model with m fields for pair_mask (nullptr if there is
+// none). Pairs with a field that pair_mask does not cover are allowed.
+unsigned char* make_mask(ffm_int m, ffm_pair_mask const *pair_mask)
 {
-#if defined USEOMP
-    ffm_int old_nr_threads = omp_get_num_threads();
-    omp_set_num_threads(param.nr_threads);
-#endif
+    if(pair_mask == nullptr)
+        return nullptr;
 
-    FILE *f_tr = fopen(tr_path.c_str(), "rb");
-    FILE *f_va = nullptr;
-    if(!va_path.empty())
-        f_va = fopen(va_path.c_str(), "rb");
+    unsigned char *mask = new unsigned char[(ffm_long)m*m];
+    for(ffm_int f1 = 0; f1 < m; f1++)
+        for(ffm_int f2 = 0; f2 < m; f2++)
+            mask[(ffm_long)f1*m+f2] = f1 >= pair_mask->m || f2 >= pair_mask->m || 
+                                      pair_mask->allowed[(ffm_long)f1*pair_mask->m+f2];
 
-    ffm_int m, n, max_l;
-    ffm_long max_nnz;
-    fread(&m, sizeof(ffm_int), 1, f_tr);
-    fread(&n, sizeof(ffm_int), 1, f_tr);
-    fread(&max_l, sizeof(ffm_int), 1, f_tr);
-    fread(&max_nnz, sizeof(ffm_long), 1, f_tr);
+    return mask;
+}
 
-    shared_ptr<ffm_model> model = 
-        shared_ptr<ffm_model>(init_model(n, m, param),
-            [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+ffm_model* init_model(ffm_int n, ffm_int m, ffm_parameter param)
+{
+    ffm_int k_aligned = (ffm_int)ceil((ffm_double)param.k/kALIGN)*kALIGN;
 
-    vector<ffm_float> Y;
-    Y.reserve(max_l);
-    vector<ffm_float> R;
-    R.reserve(max_l);
-    vector<ffm_long> P;
-    P.reserve(max_l+1);
-    vector<ffm_node> X;
-    X.reserve(max_nnz);
+    ffm_model *model = new ffm_model;
+    model->n = n;
+    model->k = k_aligned;
+    model->m = m;
+    model->W = nullptr;
+    model->J = nullptr;
+    model->mask = nullptr;
+    model->normalization = param.normalization;
+    
+    try
+    {
+        model->W = malloc_huge_float((ffm_long)n*m*k_aligned*2, "W");
+        model->mask = make_mask(m, param.pair_mask);
+    }
+    catch(bad_alloc const &e)
+    {
+        ffm_destroy_model(&model);
+        throw;
+    }
 
-    bool auto_stop = param.auto_stop && !va_path.empty();
+    ffm_float coef = 1.0f/sqrt(param.k);
+    ffm_float *w = model->W;
 
-    ffm_int k_aligned = (ffm_int)ceil((ffm_double)param.k/kALIGN)*kALIGN;
-    ffm_long w_size = (ffm_long)model->n * model->m * k_aligned * 2;
-    vector<ffm_float> prev_W;
-    if(auto_stop)
-        prev_W.assign(w_size, 0);
-    ffm_double best_va_loss = numeric_limits<ffm_double>::max();
+    default_random_engine generator;
+    uniform_real_distribution<ffm_float> distribution(0.0, 1.0);
 
-    if(!param.quiet)
+    for(ffm_int j = 0; j < model->n; j++)
     {
-        if(param.auto_stop && va_path.empty())
-            cerr << "warning: ignoring auto-stop because there is no validation set" << endl;
-        cout.width(4);
-        cout << "iter";
-        cout.width(13);
-        cout << "tr_logloss";
-        if(!va_path.empty())
+        for(ffm_int f = 0; f < model->m; f++)
         {
-            cout.width(13);
-            cout << "va_logloss";
+            for(ffm_int d = 0; d < param.k; d++, w++)
+                *w = coef*distribution(generator);
+            for(ffm_int d = param.k; d < k_aligned; d++, w++)
+                *w = 0;
+            for(ffm_int d = k_aligned; d < 2*k_aligned; d++, w++)
+                *w = 1;
         }
-        cout << endl;
     }
 
-    for(ffm_int iter = 1; iter <= param.nr_iters; iter++)
+    return model;
+}
+
+// A model to continue training init (in training layout) on a problem with
+// n features and m fields. Features and fields that init has not seen are
+// added and initialized as by init_model.
+ffm_model* init_model(ffm_int n, ffm_int m, ffm_parameter param, ffm_model const &init)
+{
+    ffm_model *model = init_model(max(n, init.n), max(m, init.m), param);
+    ffm_long align0 = (ffm_long)model->k*2;
+
+    for(ffm_int j = 0; j < init.n; j++)
     {
-        ffm_double tr_loss = 0;
+        ffm_float const *src = init.W + (ffm_long)j*init.m*align0;
+        ffm_float *dst = model->W + (ffm_long)j*model->m*align0;
+        copy(src, src+init.m*align0, dst);
+    }
 
-        fseek(f_tr, 3*sizeof(ffm_int)+sizeof(ffm_long), SEEK_SET);
+    return model;
+}
 
-        ffm_int tr_l = 0;
-        while(true)
-        {
-            ffm_int l;
-            fread(&l, sizeof(ffm_int), 1, f_tr);
-            tr_l += l;
-            if(l == 0)
-                break;
+bool save_checkpoint(ffm_model const &model, ffm_int k, char const *path)
+{
+    FILE *f = fopen(path, "wb");
+    if(f == nullptr)
+        return false;
+
+    ffm_int normalization = model.normalization;
+    ffm_long w_size = (ffm_long)model.n*model.m*model.k*2;
+
+    fwrite(kCHECKPOINT_MAGIC, 1, sizeof(kCHECKPOINT_MAGIC), f);
+    fwrite(&kCHECKPOINT_VERSION, sizeof(ffm_int), 1, f);
+    fwrite(&model.n, sizeof(ffm_int), 1, f);
+    fwrite(&model.m, sizeof(ffm_int), 1, f);
+    fwrite(&k, sizeof(ffm_int), 1, f);
+    fwrite(&model.k, sizeof(ffm_int), 1, f);
+    fwrite(&normalization, sizeof(ffm_int), 1, f);
+    fwrite(model.W, sizeof(ffm_float), w_size, f);
+
+    bool failed = ferror(f) != 0;
+    return fclose(f) == 0 && !failed;
+}
+
+// Load a checkpoint into a model in training layout, and its number of latent
+// factors into k. Returns a nullptr if the file is not a valid checkpoint.
+ffm_model* load_checkpoint(char const *path, ffm_int &k)
+{
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return nullptr;
+
+    char magic[sizeof(kCHECKPOINT_MAGIC)];
+    ffm_int version = 0, normalization = 0;
+
+    ffm_model *model = new ffm_model;
+    model->W = nullptr;
+    model->J = nullptr;
+    model->mask = nullptr;
+
+    bool ok = 
+        fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+        memcmp(magic, kCHECKPOINT_MAGIC, sizeof(magic)) == 0 &&
+        fread(&version, sizeof(ffm_int), 1, f) == 1 &&
+        version == kCHECKPOINT_VERSION &&
+        fread(&model->n, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&model->m, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&k, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&model->k, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&normalization, sizeof(ffm_int), 1, f) == 1 &&
+        model->n >= 0 && model->m >= 0 && k > 0 && 
+        model->k == (ffm_int)ceil((ffm_double)k/kALIGN)*kALIGN;
+
+    if(ok)
+    {
+        ffm_long w_size = (ffm_long)model->n*model->m*model->k*2;
+        model->normalization = normalization != 0;
+        model->W = malloc_huge_float(w_size, "W");
+        ok = fread(model->W, sizeof(ffm_float), w_size, f) == (size_t)w_size;
+    }
+    fclose(f);
 
-            Y.resize(l);
-            fread(Y.data(), sizeof(ffm_float), l, f_tr);
+    if(!ok)
+    {
+        ffm_destroy_model(&model);
+        return nullptr;
+    }
 
-            R.resize(l);
-            fread(R.data(), sizeof(ffm_float), l, f_tr);
+    return model;
+}
 
-            P.resize(l+1);
-            fread(P.data(), sizeof(ffm_long), l+1, f_tr);
+void shrink_model(ffm_model &model, ffm_int k_new)
+{
+    for(ffm_int j = 0; j < model.n; j++)
+    {
+        for(ffm_int f = 0; f < model.m; f++)
+        {
+            ffm_float *src = model.W + ((ffm_long)j*model.m+f)*model.k*2;
+            ffm_float *dst = model.W + ((ffm_long)j*model.m+f)*k_new;
+            copy(src, src+k_new, dst);
+        }
+    }
 
-            X.resize(P[l]);
-            fread(X.data(), sizeof(ffm_node), P[l], f_tr);
+    model.k = k_new;
+}
 
+vector<ffm_float> normalize(ffm_problem &prob, ffm_int nr_threads)
+{
+    vector<ffm_float> R(prob.l);
 #if defined USEOMP
-#pragma omp parallel for schedule(static) reduction(+: tr_loss)
+#pragma omp parallel for schedule(static) num_threads(nr_threads)
 #endif
-            for(ffm_int i = 0; i < l; i++)
-            {
-                ffm_float y = Y[i];
-                
-                ffm_node *begin = &X[P[i]];
+    for(ffm_int i = 0; i < prob.l; i++)
+    {
+        ffm_float norm = 0;
+        if(prob.X != nullptr)
+            for(ffm_long p = prob.P[i]; p < prob.P[i+1]; p++)
+                norm += prob.X[p].v*prob.X[p].v;
+        else if(prob.V != nullptr)
+            for(ffm_long p = prob.P[i]; p < prob.P[i+1]; p++)
+                norm += prob.V[p]*prob.V[p];
+        else
+            norm = (ffm_float)(prob.P[i+1]-prob.P[i]);
+        R[i] = 1/norm;
+    }
 
-                ffm_node *end = &X[P[i+1]];
+    return R;
+}
 
-                ffm_float r = param.normalization? R[i] : 1;
+// Pre-epoch values of the rows (w_{j,f} with its accumulators) updated in an
+// epoch, so that auto-stop can roll the epoch back without keeping a copy of
+// the whole model. The first thread to update a row in the epoch claims a slot
+// for it and saves the row there; other threads wait until that is done. The
+// slot of each row is 0 = not saved, 1 = being saved, or s+2 = saved in slot s.
+//
+// Together with the live model, the log is also a snapshot of the model as it
+// was at the start of the epoch, which the background validation reads.
+class UndoLog
+{
+public:
+    UndoLog(ffm_long nr_rows, ffm_long row_size)
+        : row_size(row_size), nr_slots(0), slot_of_row(nr_rows), blocks(nr_rows/kBlockRows+1)
+    {
+        if(nr_rows > (ffm_long)UINT_MAX-2)
+            throw runtime_error("the model has too many rows for auto-stop");
+    }
 
-                ffm_float t = wTx(begin, end, r, *model);
+    ~UndoLog()
+    {
+        for(atomic<Block*> &block : blocks)
+            delete block.load();
+    }
 
-                ffm_float expnyt = exp(-y*t);
+    // Call before updating the row of model that w points to.
+    void save(ffm_model const &model, ffm_float const *w)
+    {
+        ffm_long row = (w-model.W)/row_size;
 
-                tr_loss += log(1+expnyt);
-                   
-                ffm_float kappa = -y*expnyt/(1+expnyt);
+        ffm_uint s = slot_of_row[row].load(memory_order_acquire);
+        if(s >= 2)
+            return;
 
-                wTx(begin, end, r, *model, kappa, param.eta, param.lambda, true);
-            }
+        ffm_uint expected = 0;
+        if(s == 0 && slot_of_row[row].compare_exchange_strong(expected, 1, memory_order_acquire))
+        {
+            ffm_uint slot = nr_slots.fetch_add(1, memory_order_relaxed);
+            Block *block = get_block(slot/kBlockRows);
+            ffm_long offset = slot%kBlockRows;
+            ffm_float const *begin = model.W + row*row_size;
+            block->rows[offset] = row;
+            copy(begin, begin+row_size, block->values.begin()+offset*row_size);
+            slot_of_row[row].store(slot+2, memory_order_release);
+            return;
         }
 
-        if(!param.quiet)
-        {
-            tr_loss /= tr_l;
+        while(slot_of_row[row].load(memory_order_acquire) < 2)
+            ;
+    }
 
-            cout.width(4);
-            cout << iter;
-            cout.width(13);
-            cout << fixed << setprecision(5) << tr_loss;
+    // Where to read the value that w of model had at the start of the epoch.
+    ffm_float *snapshot(ffm_model const &model, ffm_float *w) const
+    {
+        ffm_long index = w-model.W;
+        ffm_long row = index/row_size;
+        ffm_uint s = slot_of_row[row].load(memory_order_acquire);
+        if(s < 2)
+            return w;
+        Block *block = blocks[(s-2)/kBlockRows].load(memory_order_acquire);
+        return block->values.data() + ((s-2)%kBlockRows)*row_size + (index-row*row_size);
+    }
 
-            if(f_va != nullptr)
-            {
-                fseek(f_va, 3*sizeof(ffm_int)+sizeof(ffm_long), SEEK_SET);
+    // Whether a row read from the model by snapshot() was still unsaved, and
+    // hence unchanged, after it was read.
+    bool unchanged(ffm_model const &model, ffm_float const *w) const
+    {
+        atomic_thread_fence(memory_order_acquire);
+        return slot_of_row[(w-model.W)/row_size].load(memory_order_relaxed) < 2;
+    }
 
-                ffm_int va_l = 0;
-                ffm_double va_loss = 0;
-                while(true)
-                {
-                    ffm_int l;
-                    fread(&l, sizeof(ffm_int), 1, f_va);
-                    va_l += l;
-                    if(l == 0)
-                        break;
+    // Restore the saved rows of W.
+    void rollback(ffm_float *W)
+    {
+        ffm_uint size = nr_slots.load();
+        for(ffm_uint slot = 0; slot < size; slot++)
+        {
+            Block *block = blocks[slot/kBlockRows].load();
+            ffm_float const *values = block->values.data() + (slot%kBlockRows)*row_size;
+            copy(values, values+row_size, W + block->rows[slot%kBlockRows]*row_size);
+        }
+    }
 
-                    vector<ffm_float> Y(l);
-                    fread(Y.data(), sizeof(ffm_float), l, f_va);
+    // Accept the updates of the epoch and start a new one.
+    void commit()
+    {
+        ffm_uint size = nr_slots.load();
+        for(ffm_uint slot = 0; slot < size; slot++)
+            slot_of_row[blocks[slot/kBlockRows].load()->rows[slot%kBlockRows]].store(0, memory_order_relaxed);
+        nr_slots.store(0);
+    }
 
-                    vector<ffm_float> R(l);
-                    fread(R.data(), sizeof(ffm_float), l, f_va);
+private:
+    static ffm_int const kBlockRows = 4096;
 
-                    vector<ffm_long> P(l+1);
-                    fread(P.data(), sizeof(ffm_long), l+1, f_va);
+    struct Block
+    {
+        Block(ffm_long row_size) : rows(kBlockRows), values(kBlockRows*row_size) {}
+        vector<ffm_long> rows;
+        vector<ffm_float> values;
+    };
 
-                    vector<ffm_node> X(P[l]);
-                    fread(X.data(), sizeof(ffm_node), P[l], f_va);
+    // Blocks are allocated on demand and kept for later epochs.
+    Block* get_block(ffm_long b)
+    {
+        Block *block = blocks[b].load(memory_order_acquire);
+        if(block != nullptr)
+            return block;
+
+        Block *created = new Block(row_size);
+        if(blocks[b].compare_exchange_strong(block, created, memory_order_acq_rel))
+            return created;
+        delete created;
+        return block;
+    }
 
-#if defined USEOMP
-#pragma omp parallel for schedule(static) reduction(+: va_loss)
-#endif
-                    for(ffm_int i = 0; i < l; i++)
-                    {
-                        ffm_float y = Y[i];
-                        
-                        ffm_node *begin = &X[P[i]];
+    ffm_long row_size;
+    atomic<ffm_uint> nr_slots;
+    vector<atomic<ffm_uint>> slot_of_row;
+    vector<atomic<Block*>> blocks;
+};
 
-                        ffm_node *end = &X[P[i+1]];
+// The rows (j, f) of a model in training layout that have been updated.
+class RowTracker
+{
+public:
+    RowTracker(ffm_long nr_rows) : changed(nr_rows) {}
 
-                        ffm_float r = param.normalization? R[i] : 1;
+    // Call when updating the row of model that w points to.
+    void mark(ffm_model const &model, ffm_float const *w)
+    {
+        changed[(w-model.W)/(model.k*2)].store(1, memory_order_relaxed);
+    }
 
-                        ffm_float t = wTx(begin, end, r, *model);
+    bool is_changed(ffm_long row) const
+    {
+        return changed[row].load(memory_order_relaxed) != 0;
+    }
 
-                        ffm_float expnyt = exp(-y*t);
+    ffm_long size() const
+    {
+        return (ffm_long)changed.size();
+    }
 
-                        va_loss += log(1+expnyt);
-                    }
-                }
-                va_loss /= va_l;
+private:
+    vector<atomic<unsigned char>> changed;
+};
 
-                cout.width(13);
-                cout << fixed << setprecision(5) << va_loss;
+// The rows (j, f) of a model in training layout that one thread has updated
+// in the current round of deterministic training, kept apart from the model,
+// which is only read during a round. Each row is stored twice: as trained,
+// and as it was when the thread first used it.
+class RowOverlay
+{
+public:
+    RowOverlay(ffm_model const &model) : row_size((ffm_long)model.k*2), nr_slots(0) {}
 
-                if(auto_stop)
-                {
-                    if(va_loss > best_va_loss)
-                    {
-                        memcpy(model->W, prev_W.data(), w_size*sizeof(ffm_float));
-                        cout << endl << "Auto-stop. Use model at " << iter-1 << "th iteration." << endl;
-                        break;
-                    }
-                    else
-                    {
-                        memcpy(prev_W.data(), model->W, w_size*sizeof(ffm_float));
-                        best_va_loss = va_loss; 
-                    }
-                }
-            }
-            cout << endl;
+    ~RowOverlay()
+    {
+        for(ffm_float *block : blocks)
+            free_aligned(block);
+    }
+
+    // Point the weights of pairs at this thread's copies of their rows.
+    void redirect(ffm_model const &model, vector<ffm_pair> &pairs)
+    {
+        for(ffm_pair &pair : pairs)
+        {
+            pair.w1 = get(model, pair.w1);
+            pair.w2 = get(model, pair.w2);
         }
     }
 
-    shrink_model(*model, param.k);
+    // Add the changes to the rows r of model with r%nr_parts == part. Called
+    // for every overlay in the same order, this sums the changes of the
+    // threads that updated a row in that order.
+    void apply(ffm_model &model, ffm_int part, ffm_int nr_parts, UndoLog *undo, RowTracker *changed) const
+    {
+        for(ffm_long s = 0; s < nr_slots; s++)
+        {
+            ffm_long row = rows[s];
+            if(row%nr_parts != part)
+                continue;
 
-    fclose(f_tr);
-    if(!va_path.empty())
-        fclose(f_va);
+            ffm_float *w = model.W + row*row_size;
+            if(undo != nullptr)
+                undo->save(model, w);
+            if(changed != nullptr)
+                changed->mark(model, w);
 
-#if defined USEOMP
-    omp_set_num_threads(old_nr_threads);
-#endif
+            ffm_float const *trained = get_slot(s);
+            ffm_float const *original = trained + row_size;
+            for(ffm_long d = 0; d < row_size; d++)
+                w[d] += trained[d]-original[d];
+        }
+    }
 
-    return model;
-}
+    void clear()
+    {
+        nr_slots = 0;
+        rows.clear();
+        slot_of_row.clear();
+    }
+
+private:
+    static ffm_long const kBlockRows = 256;
+
+    ffm_float* get_slot(ffm_long s) const
+    {
+        return blocks[s/kBlockRows] + s%kBlockRows*row_size*2;
+    }
+
+    ffm_float* get(ffm_model const &model, ffm_float *w)
+    {
+        ffm_long row = (w-model.W)/row_size;
+        auto it = slot_of_row.find(row);
+        if(it != slot_of_row.end())
+            return get_slot(it->second);
+
+        // Rows live in fixed blocks, so that pointers to them stay valid
+        // while the overlay grows.
+        if(nr_slots/kBlockRows == (ffm_long)blocks.size())
+            blocks.push_back(malloc_aligned_float(kBlockRows*row_size*2));
+
+        ffm_long s = nr_slots++;
+        ffm_float *slot = get_slot(s);
+        copy(w, w+row_size, slot);
+        copy(w, w+row_size, slot+row_size);
+        rows.push_back(row);
+        slot_of_row.emplace(row, s);
+        return slot;
+    }
+
+    ffm_long row_size;
+    ffm_long nr_slots;
+    vector<ffm_long> rows;
+    unordered_map<ffm_long, ffm_long> slot_of_row;
+    vector<ffm_float*> blocks;
+};
+
+// Write the rows of model (in training layout) that changed to path as a
+// delta with k weights per row.
+bool save_delta(ffm_model const &model, ffm_int k, RowTracker const &changed, char const *path)
+{
+    vector<ffm_long> rows;
+    for(ffm_long row = 0; row < changed.size(); row++)
+        if(changed.is_changed(row))
+            rows.push_back(row);
+
+    FILE *f = fopen(path, "wb");
+    if(f == nullptr)
+        return false;
+
+    ffm_int normalization = model.normalization;
+    ffm_long nr_rows = (ffm_long)rows.size();
+
+    fwrite(kDELTA_MAGIC, 1, sizeof(kDELTA_MAGIC), f);
+    fwrite(&kDELTA_VERSION, sizeof(ffm_int), 1, f);
+    fwrite(&model.n, sizeof(ffm_int), 1, f);
+    fwrite(&model.m, sizeof(ffm_int), 1, f);
+    fwrite(&k, sizeof(ffm_int), 1, f);
+    fwrite(&normalization, sizeof(ffm_int), 1, f);
+    fwrite(&nr_rows, sizeof(ffm_long), 1, f);
+    fwrite(rows.data(), sizeof(ffm_long), nr_rows, f);
+    for(ffm_long row : rows)
+        fwrite(model.W + row*model.k*2, sizeof(ffm_float), k, f);
+
+    bool failed = ferror(f) != 0;
+    return fclose(f) == 0 && !failed;
+}
+
+// Whether instance i with label y is trained on when negatives are sampled
+// at rate. All positives are kept; a negative is kept if a hash of i falls
+// below rate, so that the same negatives are kept in every iteration and by
+// in-memory and on-disk training alike.
+inline bool keep_instance(ffm_float y, ffm_long i, ffm_float rate)
+{
+    if(y > 0 || rate >= 1)
+        return true;
+
+    unsigned long long h = (unsigned long long)i*0x9E3779B97F4A7C15ULL;
+    h = (h^(h>>30))*0xBF58476D1CE4E5B9ULL;
+    h = (h^(h>>27))*0x94D049BB133111EBULL;
+    h ^= h>>31;
+
+    return (ffm_double)(h>>11)/(ffm_double)(1ULL<<53) < rate;
+}
+
+// Do one stochastic gradient step on each of the instances order[ii] (or ii
+// if order is a nullptr), ii in [ii_begin, ii_end), of the CSR block rows, Y,
+// with normalization factors R (1 if R is a nullptr). Negatives are weighted
+// by neg_weight, in the gradient and in the loss. With an overlay, the
+// updates go to the overlay instead of the model. Returns the sum of their
+// weighted logloss before the updates.
+ffm_double train_range(
+    Rows const &rows,
+    ffm_float const *Y,
+    ffm_float const *R,
+    ffm_int const *order,
+    ffm_int ii_begin,
+    ffm_int ii_end,
+    ffm_model &model, 
+    ffm_parameter const &param,
+    UndoLog *undo=nullptr,
+    RowTracker *changed=nullptr,
+    ffm_float neg_weight=1,
+    RowOverlay *overlay=nullptr)
+{
+    ffm_int distance = param.prefetch_distance;
+    vector<ffm_pair> pairs, next_pairs;
+
+    ffm_double loss = 0;
+    if(ii_begin < ii_end)
+    {
+        ffm_int i = order != nullptr? order[ii_begin] : ii_begin;
+        get_pairs(rows, i, model, next_pairs);
+        if(overlay != nullptr)
+            overlay->redirect(model, next_pairs);
+    }
+
+    for(ffm_int ii = ii_begin; ii < ii_end; ii++)
+    {
+        ffm_int i = order != nullptr? order[ii] : ii;
+
+        swap(pairs, next_pairs);
+        next_pairs.clear();
+        if(ii+1 < ii_end)
+        {
+            ffm_int i_next = order != nullptr? order[ii+1] : ii+1;
+            get_pairs(rows, i_next, model, next_pairs);
+            if(overlay != nullptr)
+                overlay->redirect(model, next_pairs);
+        }
+
+        ffm_float y = Y[i];
+
+        ffm_float r = R != nullptr? R[i] : 1;
+
+        ffm_float w = y > 0? 1 : neg_weight;
+
+        ffm_float t = wTx(pairs, r, model, 0, 0, 0, false, distance);
+
+        ffm_float expnyt = exp(-y*t);
+
+        loss += w*log(1+expnyt);
+           
+        ffm_float kappa = -w*y*expnyt/(1+expnyt);
+
+        if(undo != nullptr)
+        {
+            for(ffm_pair const &pair : pairs)
+            {
+                undo->save(model, pair.w1);
+                undo->save(model, pair.w2);
+            }
+        }
+
+        if(changed != nullptr)
+        {
+            for(ffm_pair const &pair : pairs)
+            {
+                changed->mark(model, pair.w1);
+                changed->mark(model, pair.w2);
+            }
+        }
+
+        wTx(pairs, r, model, kappa, param.eta, param.lambda, true, distance, &next_pairs);
+    }
+
+    return loss;
+}
+
+// Sum of the logloss of instances [i_begin, i_end) of a CSR block.
+ffm_double evaluate_range(
+    Rows const &rows,
+    ffm_float const *Y,
+    ffm_float const *R,
+    ffm_int i_begin,
+    ffm_int i_end,
+    ffm_model &model, 
+    ffm_parameter const &param,
+    UndoLog const *snapshot=nullptr)
+{
+    vector<ffm_pair> pairs, live_pairs;
+
+    ffm_double loss = 0;
+    for(ffm_int i = i_begin; i < i_end; i++)
+    {
+        get_pairs(rows, i, model, pairs);
+
+        ffm_float y = Y[i];
+
+        ffm_float r = R != nullptr? R[i] : 1;
+
+        ffm_float t = 0;
+        if(snapshot == nullptr)
+        {
+            t = wTx(pairs, r, model, 0, 0, 0, false, param.prefetch_distance);
+        }
+        else
+        {
+            // Score the model as it was at the start of the epoch being
+            // trained. Rows that were saved while they were read from the
+            // live model may have changed, so then score again.
+            live_pairs = pairs;
+            bool consistent = false;
+            while(!consistent)
+            {
+                for(size_t p = 0; p < pairs.size(); p++)
+                {
+                    pairs[p].w1 = snapshot->snapshot(model, live_pairs[p].w1);
+                    pairs[p].w2 = snapshot->snapshot(model, live_pairs[p].w2);
+                }
+
+                t = wTx(pairs, r, model, 0, 0, 0, false, param.prefetch_distance);
+
+                consistent = true;
+                for(size_t p = 0; p < pairs.size() && consistent; p++)
+                    consistent = (pairs[p].w1 != live_pairs[p].w1 || snapshot->unchanged(model, pairs[p].w1)) &&
+                                 (pairs[p].w2 != live_pairs[p].w2 || snapshot->unchanged(model, pairs[p].w2));
+            }
+        }
+        
+        ffm_float expnyt = exp(-y*t);
+
+        loss += log(1+expnyt);
+    }
+
+    return loss;
+}
+
+// CPUs of each NUMA node that this process may run on. Nodes without usable
+// CPUs are dropped. If the topology is unknown, all CPUs form one node.
+vector<vector<ffm_int>> get_numa_cpus()
+{
+    vector<vector<ffm_int>> nodes;
+#if defined __linux__
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    for(ffm_int node = 0; ; node++)
+    {
+        ifstream f_in("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        if(!f_in.is_open())
+            break;
+
+        string list;
+        getline(f_in, list);
+
+        vector<ffm_int> cpus;
+        for(char const *ptr = list.c_str(); *ptr != '\0';)
+        {
+            char *next;
+            ffm_int first = strtol(ptr, &next, 10);
+            if(next == ptr)
+                break;
+            ffm_int last = first;
+            if(*next == '-')
+                last = strtol(next+1, &next, 10);
+            for(ffm_int cpu = first; cpu <= last; cpu++)
+                if(CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+            ptr = *next == ','? next+1 : next;
+        }
+
+        if(!cpus.empty())
+            nodes.push_back(cpus);
+    }
+
+    if(nodes.empty())
+    {
+        vector<ffm_int> cpus;
+        for(ffm_int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if(CPU_ISSET(cpu, &allowed))
+                cpus.push_back(cpu);
+        nodes.push_back(cpus);
+    }
+#endif
+    return nodes;
+}
+
+// Choose a CPU for each OpenMP thread t of a team of nr_threads: one of
+// node t*nr_nodes/nr_threads, so the threads of a team are spread over the
+// nodes in contiguous blocks. Returns the (compacted) node index of each
+// thread, and the CPUs in cpu_of_thread (left empty where threads cannot be
+// pinned).
+vector<ffm_int> pin_threads(ffm_int nr_threads, vector<ffm_int> &cpu_of_thread)
+{
+    vector<ffm_int> node_of_thread(nr_threads, 0);
+    cpu_of_thread.clear();
+#if defined __linux__ && defined USEOMP
+    vector<vector<ffm_int>> nodes = get_numa_cpus();
+    ffm_int nr_nodes = min((ffm_int)nodes.size(), nr_threads);
+
+    for(ffm_int t = 0; t < nr_threads; t++)
+    {
+        ffm_int node = (ffm_long)t*nr_nodes/nr_threads;
+        ffm_int rank = t - (ffm_int)(((ffm_long)node*nr_threads+nr_nodes-1)/nr_nodes);
+        vector<ffm_int> const &cpus = nodes[node];
+        node_of_thread[t] = node;
+        cpu_of_thread.push_back(cpus[rank%cpus.size()]);
+    }
+#endif
+    return node_of_thread;
+}
+
+// Pin the calling thread, thread tid of its team, to its CPU from
+// pin_threads. OpenMP does not promise that a team runs on the same OS threads
+// as the previous one, so every parallel region that relies on the pinning
+// calls this first. Does nothing if cpu_of_thread is empty.
+inline void pin_thread(vector<ffm_int> const &cpu_of_thread, ffm_int tid)
+{
+#if defined __linux__ && defined USEOMP
+    if(cpu_of_thread.empty())
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu_of_thread[tid], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+// Undo pin_thread: let every thread of the team run on all CPUs the process
+// was allowed to use.
+void unpin_threads(ffm_int nr_threads)
+{
+#if defined __linux__ && defined USEOMP
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    for(vector<ffm_int> const &cpus : get_numa_cpus())
+        for(ffm_int cpu : cpus)
+            CPU_SET(cpu, &allowed);
+
+#pragma omp parallel num_threads(nr_threads)
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+#endif
+}
+
+// Copies of a model shared by groups of threads. Thread t trains on
+// replica_of_thread[t]; replica 0 is the model itself. With more than one
+// replica, every replica, replica 0 included, is allocated anew and first
+// touched (copied) by its own threads, pinned to cpu_of_thread, so that its
+// pages end up on their NUMA node; the model's W is then replaced by replica
+// 0's. average() replaces all replicas by their mean, summing them in a fixed
+// order.
+class ReplicaSet
+{
+public:
+    ReplicaSet(
+        ffm_model &model, 
+        ffm_long w_size, 
+        vector<ffm_int> const &replica_of_thread, 
+        vector<ffm_int> const &cpu_of_thread=vector<ffm_int>());
+    ~ReplicaSet();
+    ffm_model& get(ffm_int tid) { return replicas[replica_of_thread[tid]]; }
+    ffm_int size() const { return (ffm_int)replicas.size(); }
+    void average();
+
+private:
+    ffm_long w_size;
+    vector<ffm_int> replica_of_thread;
+    vector<ffm_int> cpu_of_thread;
+    vector<ffm_model> replicas;
+};
+
+ReplicaSet::ReplicaSet(
+    ffm_model &model, 
+    ffm_long w_size, 
+    vector<ffm_int> const &replica_of_thread,
+    vector<ffm_int> const &cpu_of_thread)
+    : w_size(w_size), replica_of_thread(replica_of_thread), cpu_of_thread(cpu_of_thread)
+{
+    ffm_int nr_replicas = *max_element(replica_of_thread.begin(), replica_of_thread.end())+1;
+
+    replicas.assign(nr_replicas, model);
+    if(nr_replicas == 1)
+        return;
+
+    for(ffm_int r = 0; r < nr_replicas; r++)
+        replicas[r].W = nullptr;
+
+    try
+    {
+        for(ffm_int r = 0; r < nr_replicas; r++)
+            replicas[r].W = malloc_huge_float(w_size, "W replica");
+    }
+    catch(bad_alloc const &e)
+    {
+        for(ffm_int r = 0; r < nr_replicas; r++)
+            free_aligned(replicas[r].W);
+        throw;
+    }
+
+    ffm_int nr_threads = (ffm_int)replica_of_thread.size();
+#if defined USEOMP
+#pragma omp parallel num_threads(nr_threads)
+#endif
+    {
+        ffm_int tid = get_thread_num();
+        pin_thread(cpu_of_thread, tid);
+
+        ffm_int r = replica_of_thread[tid];
+        ffm_int rank = 0, size = 0;
+        for(ffm_int t = 0; t < nr_threads; t++)
+        {
+            if(replica_of_thread[t] != r)
+                continue;
+            if(t < tid)
+                rank++;
+            size++;
+        }
+
+        ffm_long begin = w_size*rank/size/kALIGN*kALIGN;
+        ffm_long end = rank+1 == size? w_size : w_size*(rank+1)/size/kALIGN*kALIGN;
+        copy(model.W+begin, model.W+end, replicas[r].W+begin);
+    }
+
+    free_aligned(model.W);
+    model.W = replicas[0].W;
+}
+
+ReplicaSet::~ReplicaSet()
+{
+    for(ffm_int r = 1; r < size(); r++)
+        free_aligned(replicas[r].W);
+}
+
+void ReplicaSet::average()
+{
+    ffm_int const kBlockSize = 4096;
+
+    ffm_int nr_replicas = size();
+    if(nr_replicas == 1)
+        return;
+
+    ffm_float scale = 1.0f/nr_replicas;
+    ffm_long nr_blocks = (w_size+kBlockSize-1)/kBlockSize;
+
+#if defined USEOMP
+#pragma omp parallel for schedule(static) num_threads((ffm_int)replica_of_thread.size())
+#endif
+    for(ffm_long b = 0; b < nr_blocks; b++)
+    {
+        ffm_long begin = b*kBlockSize;
+        ffm_int size = (ffm_int)min((ffm_long)kBlockSize, w_size-begin);
+
+        // Average as w_0 + mean(w_r - w_0), so that values that no replica
+        // changed stay exactly the same.
+        ffm_float sum[kBlockSize] = {0};
+        ffm_float const *w0 = replicas[0].W+begin;
+        for(ffm_int r = 1; r < nr_replicas; r++)
+        {
+            ffm_float const *w = replicas[r].W+begin;
+            for(ffm_int i = 0; i < size; i++)
+                sum[i] += w[i]-w0[i];
+        }
+        for(ffm_int i = 0; i < size; i++)
+            sum[i] = w0[i] + sum[i]*scale;
+        for(ffm_int r = 0; r < nr_replicas; r++)
+            copy(sum, sum+size, replicas[r].W+begin);
+    }
+}
+
+// Shuffle `order' for one epoch. With block_size == 0 this is a full
+// shuffle. Otherwise the sorted order is cut into blocks of block_size
+// consecutive instances, the blocks are permuted, and instances are shuffled
+// only within their block, so that reads stay within a few contiguous
+// regions of the problem at a time.
+void shuffle_order(vector<ffm_int> &order, ffm_int block_size)
+{
+    if(block_size <= 0)
+    {
+        random_shuffle(order.begin(), order.end());
+        return;
+    }
+
+    sort(order.begin(), order.end());
+
+    ffm_int nr_blocks = (ffm_int)((order.size()+block_size-1)/block_size);
+    vector<ffm_int> blocks(nr_blocks);
+    iota(blocks.begin(), blocks.end(), 0);
+    random_shuffle(blocks.begin(), blocks.end());
+
+    vector<ffm_int> shuffled;
+    shuffled.reserve(order.size());
+    for(ffm_int b : blocks)
+    {
+        auto begin = order.begin()+(ffm_long)b*block_size;
+        auto end = order.begin()+min((ffm_long)(b+1)*block_size, (ffm_long)order.size());
+        auto pos = shuffled.insert(shuffled.end(), begin, end);
+        random_shuffle(pos, shuffled.end());
+    }
+
+    order.swap(shuffled);
+}
+
+// A copy of (a subset of) a problem with its instances stored in training
+// order, so that an epoch reads X sequentially. The copy keeps the form
+// (nodes or compact) of the problem.
+struct Layout
+{
+    vector<ffm_node> X;
+    vector<unsigned char> F;
+    vector<ffm_uint> I;
+    vector<ffm_float> V;
+    vector<ffm_long> P;
+    vector<ffm_float> Y;
+    vector<ffm_float> R;
+
+    Rows rows() const
+    {
+        Rows rows = {X.data(), F.data(), I.data(), V.data(), P.data()};
+        if(X.empty())
+            rows.X = nullptr;
+        if(V.empty())
+            rows.V = nullptr;
+        return rows;
+    }
+};
+
+void relayout(
+    ffm_problem const &prob, 
+    vector<ffm_float> const &R, 
+    vector<ffm_int> const &order, 
+    Layout &layout)
+{
+    layout.X.clear();
+    layout.F.clear();
+    layout.I.clear();
+    layout.V.clear();
+    layout.P.assign(1, 0);
+    layout.Y.clear();
+    layout.R.clear();
+
+    for(ffm_int i : order)
+    {
+        ffm_long begin = prob.P[i], end = prob.P[i+1];
+        if(prob.X != nullptr)
+        {
+            layout.X.insert(layout.X.end(), prob.X+begin, prob.X+end);
+        }
+        else
+        {
+            layout.F.insert(layout.F.end(), prob.F+begin, prob.F+end);
+            layout.I.insert(layout.I.end(), prob.I+begin, prob.I+end);
+            if(prob.V != nullptr)
+                layout.V.insert(layout.V.end(), prob.V+begin, prob.V+end);
+        }
+        layout.P.push_back(layout.P.back()+end-begin);
+        layout.Y.push_back(prob.Y[i]);
+        layout.R.push_back(R[i]);
+    }
+}
+
+shared_ptr<ffm_model> train(
+    ffm_problem *tr, 
+    vector<ffm_int> &order, 
+    ffm_parameter param, 
+    ffm_problem *va=nullptr,
+    ffm_model const *init=nullptr,
+    bool shrink=true,
+    unique_ptr<RowTracker> *changed=nullptr)
+{
+    shared_ptr<ffm_model> model = 
+        shared_ptr<ffm_model>(init != nullptr? init_model(tr->n, tr->m, param, *init) : init_model(tr->n, tr->m, param),
+            [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+
+    // If changed is given, it is set to the rows that training updates.
+    if(changed != nullptr)
+        changed->reset(new RowTracker((ffm_long)model->n*model->m));
+    RowTracker *tracker = changed != nullptr? changed->get() : nullptr;
+
+    // With negative sampling, only the positives and the kept negatives are
+    // trained on, and each kept negative stands for 1/rate of them. The
+    // training loss is then the weighted mean over the kept instances.
+    ffm_float neg_weight = 1;
+    ffm_double tr_weight = tr->l;
+    if(param.neg_sample_rate < 1)
+    {
+        ffm_float rate = param.neg_sample_rate;
+        order.erase(remove_if(order.begin(), order.end(), 
+                              [&] (ffm_int i) { return !keep_instance(tr->Y[i], i, rate); }), 
+                    order.end());
+        neg_weight = 1/rate;
+        tr_weight = 0;
+        for(ffm_int i : order)
+            tr_weight += tr->Y[i] > 0? 1 : neg_weight;
+    }
+
+    vector<ffm_float> R_tr, R_va;
+    if(param.normalization)
+    {
+        R_tr = normalize(*tr, param.nr_threads);
+        if(va != nullptr)
+            R_va = normalize(*va, param.nr_threads);
+    }
+    else
+    {
+        R_tr = vector<ffm_float>(tr->l, 1);
+        if(va != nullptr)
+            R_va = vector<ffm_float>(va->l, 1);
+    }
+
+    bool auto_stop = param.auto_stop && va != nullptr && va->l != 0;
+    bool validate = va != nullptr && va->l != 0 && (!param.quiet || auto_stop);
+
+    // With more than two threads, the model of each iteration is validated by
+    // a few threads of its own while the others train the next iteration. The
+    // split follows the work: validation costs about a third of training per
+    // node. Iterations with no validation running train with all threads.
+    // NUMA and deterministic mode tie every thread to a replica for the whole
+    // run, so they validate in between iterations.
+    ffm_int nr_va_threads = 0;
+    if(validate && param.nr_threads > 2 && !param.numa && !param.deterministic)
+    {
+        ffm_double va_nnz = (ffm_double)va->P[va->l];
+        ffm_double tr_nnz = (ffm_double)tr->P[tr->l];
+        nr_va_threads = (ffm_int)llround(param.nr_threads*va_nnz/(va_nnz+3*tr_nnz));
+        nr_va_threads = max(1, min(param.nr_threads-1, nr_va_threads));
+    }
+
+    ffm_int k_aligned = (ffm_int)ceil((ffm_double)param.k/kALIGN)*kALIGN;
+    ffm_long w_size = (ffm_long)model->n * model->m * k_aligned * 2;
+    ffm_double best_va_loss = numeric_limits<ffm_double>::max();
+
+    // Only the rows updated since the last accepted iteration are kept for
+    // rolling back. Validation in the background reads the model of the
+    // previous iteration through the log of the current one and decides one
+    // iteration late, so the last two iterations are logged separately.
+    ffm_int nr_undo = nr_va_threads > 0? 2 : 1;
+    unique_ptr<UndoLog> undo[2];
+    if(auto_stop || nr_va_threads > 0)
+        for(ffm_int u = 0; u < nr_undo; u++)
+            undo[u].reset(new UndoLog((ffm_long)model->n*model->m, k_aligned*2));
+
+    // In NUMA mode every node trains its own replica, Hogwild-style among the
+    // node's threads; otherwise all threads share the model.
+    vector<ffm_int> replica_of_thread(param.nr_threads, 0), cpu_of_thread;
+    if(param.numa)
+        replica_of_thread = pin_threads(param.nr_threads, cpu_of_thread);
+    ReplicaSet replicas(*model, w_size, replica_of_thread, cpu_of_thread);
+
+    // In deterministic mode the threads train in rounds of kROUND_SIZE
+    // consecutive instances, each thread a fixed part of them. During a round
+    // the model is only read, and every thread's updates go to an overlay of
+    // the rows it used; after the round, the changes of all overlays are added
+    // to the model in thread order. The updates that a round adds up were all
+    // computed from the same model, so rounds have to stay short: summing the
+    // changes of a whole iteration makes training diverge on rows that most
+    // instances use.
+    ffm_int const kROUND_SIZE = 256;
+    vector<unique_ptr<RowOverlay>> overlays;
+    if(param.deterministic && param.nr_threads > 1)
+        for(ffm_int t = 0; t < param.nr_threads; t++)
+            overlays.emplace_back(new RowOverlay(*model));
+
+    bool use_layout = param.random && param.relayout;
+    Layout layout, next_layout;
+    thread relayout_thread;
+    if(use_layout)
+    {
+        shuffle_order(order, param.block_size);
+        relayout_thread = thread(relayout, cref(*tr), cref(R_tr), order, ref(next_layout));
+    }
+
+    if(!param.quiet)
+    {
+        if(param.numa)
+            cout << "NUMA mode: " << replicas.size() << " model replica(s)" << endl;
+
+        if(param.auto_stop && (va == nullptr || va->l == 0))
+            cerr << "warning: ignoring auto-stop because there is no validation set" << endl;
+
+        cout.width(4);
+        cout << "iter";
+        cout.width(13);
+        cout << "tr_logloss";
+        if(va != nullptr && va->l != 0)
+        {
+            cout.width(13);
+            cout << "va_logloss";
+        }
+        cout << endl;
+    }
+
+    // Losses are summed per thread and then in thread order, so that they do
+    // not depend on the order in which threads finish.
+    auto validation_loss = [&] (ffm_int nr_threads, UndoLog const *snapshot)
+    {
+        vector<ffm_double> losses(nr_threads, 0);
+#if defined USEOMP
+#pragma omp parallel num_threads(nr_threads)
+#endif
+        {
+            ffm_int tid = get_thread_num();
+            ffm_int nt = get_num_threads();
+
+            losses[tid] = evaluate_range(get_rows(*va), va->Y, R_va.data(), 
+                                         (ffm_long)va->l*tid/nt, (ffm_long)va->l*(tid+1)/nt, 
+                                         *model, param, snapshot);
+        }
+        return accumulate(losses.begin(), losses.end(), 0.0)/va->l;
+    };
+
+    // Print the losses of iteration `iter' and decide on auto-stop, given
+    // that the model has been trained up to iteration `last'. Returns true to
+    // stop, with the model rolled back to iteration iter-1.
+    auto report = [&] (ffm_int iter, ffm_int last, ffm_double tr_loss, ffm_double va_loss)
+    {
+        if(!param.quiet)
+        {
+            cout.width(4);
+            cout << iter;
+            cout.width(13);
+            cout << fixed << setprecision(5) << tr_loss;
+            cout.width(13);
+            cout << fixed << setprecision(5) << va_loss;
+        }
+
+        bool stop = auto_stop && va_loss > best_va_loss;
+        if(stop)
+        {
+            for(ffm_int it = last; it >= iter; it--)
+                undo[it%nr_undo]->rollback(model->W);
+            if(!param.quiet)
+                cout << endl << "Auto-stop. Use model at " << iter-1 << "th iteration.";
+        }
+        else
+        {
+            if(undo[0] != nullptr)
+                undo[iter%nr_undo]->commit();
+            best_va_loss = min(best_va_loss, va_loss);
+        }
+
+        if(!param.quiet)
+            cout << endl;
+
+        return stop;
+    };
+
+    thread va_thread;
+    ffm_double pending_tr_loss = 0, pending_va_loss = 0;
+
+    for(ffm_int iter = 1; iter <= param.nr_iters; iter++)
+    {
+        // With relayout, the layout of this epoch was built in the background
+        // during the previous one, and the next one is built during this one.
+        if(relayout_thread.joinable())
+        {
+            relayout_thread.join();
+            swap(layout, next_layout);
+            if(iter < param.nr_iters)
+            {
+                shuffle_order(order, param.block_size);
+                relayout_thread = thread(relayout, cref(*tr), cref(R_tr), order, ref(next_layout));
+            }
+        }
+        else if(param.random)
+        {
+            shuffle_order(order, param.block_size);
+        }
+
+        UndoLog *log = undo[iter%nr_undo].get();
+
+        ffm_int nr_tr_threads = va_thread.joinable()? param.nr_threads-nr_va_threads : param.nr_threads;
+
+        auto train_part = [&] (ffm_int ii_begin, ffm_int ii_end, ffm_model &part_model, 
+                               UndoLog *part_log, RowTracker *part_tracker, RowOverlay *overlay)
+        {
+            if(use_layout)
+                return train_range(layout.rows(), layout.Y.data(), layout.R.data(), nullptr, 
+                                   ii_begin, ii_end, part_model, param, part_log, part_tracker, 
+                                   neg_weight, overlay);
+            else
+                return train_range(get_rows(*tr), tr->Y, R_tr.data(), order.data(), 
+                                   ii_begin, ii_end, part_model, param, part_log, part_tracker, 
+                                   neg_weight, overlay);
+        };
+
+        vector<ffm_double> tr_losses(nr_tr_threads, 0);
+#if defined USEOMP
+#pragma omp parallel num_threads(nr_tr_threads)
+#endif
+        {
+            ffm_int tid = get_thread_num();
+            ffm_int nt = get_num_threads();
+            pin_thread(cpu_of_thread, tid);
+
+            if(overlays.empty())
+            {
+                ffm_int ii_begin = (ffm_long)order.size()*tid/nt;
+                ffm_int ii_end = (ffm_long)order.size()*(tid+1)/nt;
+                tr_losses[tid] = train_part(ii_begin, ii_end, replicas.get(tid), log, tracker, nullptr);
+            }
+            else
+            {
+                ffm_long l = (ffm_long)order.size();
+                ffm_long round_size = max((ffm_long)kROUND_SIZE, (ffm_long)nt);
+                for(ffm_long round_begin = 0; round_begin < l; round_begin += round_size)
+                {
+                    ffm_int ii_begin = (ffm_int)min(l, round_begin+round_size*tid/nt);
+                    ffm_int ii_end = (ffm_int)min(l, round_begin+round_size*(tid+1)/nt);
+                    tr_losses[tid] += train_part(ii_begin, ii_end, *model, nullptr, nullptr, overlays[tid].get());
+#if defined USEOMP
+#pragma omp barrier
+#endif
+                    for(ffm_int t = 0; t < nt; t++)
+                        overlays[t]->apply(*model, tid, nt, log, tracker);
+#if defined USEOMP
+#pragma omp barrier
+#endif
+                    overlays[tid]->clear();
+                }
+            }
+        }
+        replicas.average();
+        ffm_double tr_loss = accumulate(tr_losses.begin(), tr_losses.end(), 0.0)/tr_weight;
+
+        // The previous iteration was validated while this one trained, on a
+        // snapshot of the model at its end: rows that this iteration updated
+        // were read from the undo log. Its loss is therefore the same as if it
+        // had been validated in between.
+        if(va_thread.joinable())
+        {
+            va_thread.join();
+            if(report(iter-1, iter, pending_tr_loss, pending_va_loss))
+                break;
+        }
+
+        if(!validate)
+        {
+            if(!param.quiet)
+            {
+                cout.width(4);
+                cout << iter;
+                cout.width(13);
+                cout << fixed << setprecision(5) << tr_loss;
+                cout << endl;
+            }
+        }
+        else if(nr_va_threads > 0 && iter < param.nr_iters)
+        {
+            pending_tr_loss = tr_loss;
+            UndoLog const *snapshot = undo[(iter+1)%nr_undo].get();
+            va_thread = thread([&, snapshot] () { pending_va_loss = validation_loss(nr_va_threads, snapshot); });
+        }
+        else if(report(iter, iter, tr_loss, validation_loss(param.nr_threads, nullptr)))
+        {
+            break;
+        }
+    }
+
+    if(relayout_thread.joinable())
+        relayout_thread.join();
+
+    if(param.numa)
+        unpin_threads(param.nr_threads);
+
+    if(shrink)
+        shrink_model(*model, param.k);
+
+    return model;
+}
+
+// Move a model trained on tr out of the shared pointer used in training.
+ffm_model* release_model(shared_ptr<ffm_model> const &model, ffm_problem const *tr)
+{
+    ffm_model *model_ret = new ffm_model;
+
+    model_ret->n = model->n;
+    model_ret->m = model->m;
+    model_ret->k = model->k;
+    model_ret->normalization = model->normalization;
+
+    model_ret->W = model->W;
+    model->W = nullptr;
+    model_ret->mask = model->mask;
+    model->mask = nullptr;
+
+    // The model was trained on remapped features; keep the mapping so that
+    // prediction can be done on the original ones.
+    model_ret->J = nullptr;
+    if(tr != nullptr && tr->J != nullptr)
+    {
+        model_ret->J = new ffm_int[model_ret->n];
+        copy(tr->J, tr->J+model_ret->n, model_ret->J);
+    }
+
+    return model_ret;
+}
+
+// Save the checkpoint and the delta of a model trained from init (either may
+// be a nullptr), and release it shrunk to k. Failures to write are reported
+// and otherwise ignored, as the model itself is still good.
+ffm_model* release_model(
+    shared_ptr<ffm_model> const &model, 
+    ffm_problem const *tr, 
+    ffm_int k, 
+    ffm_model const *init, 
+    RowTracker const *changed, 
+    char const *checkpoint_path, 
+    char const *delta_path)
+{
+    if(checkpoint_path != nullptr && !save_checkpoint(*model, k, checkpoint_path))
+        cerr << "cannot write " << checkpoint_path << endl;
+
+    if(delta_path != nullptr)
+    {
+        if(init == nullptr || init->n != model->n || init->m != model->m)
+            cerr << "cannot write " << delta_path << ": the model has new features or fields" << endl;
+        else if(!save_delta(*model, k, *changed, delta_path))
+            cerr << "cannot write " << delta_path << endl;
+    }
+
+    shrink_model(*model, k);
+
+    return release_model(model, tr);
+}
+
+// Train one model per element of params side by side. Each thread takes the
+// instances of its part of the order in small blocks and trains every model on
+// a block in turn, so that an instance is read from memory once per iteration
+// for all models. Only eta, lambda and k may differ between params; the rest
+// is taken from params[0]. Returns the models with their results.
+vector<shared_ptr<ffm_model>> train_sweep(
+    ffm_problem *tr, 
+    ffm_problem *va, 
+    ffm_parameter const *params, 
+    ffm_int nr_models,
+    ffm_sweep_result *results)
+{
+    ffm_int const kBlockSize = 64;
+
+    ffm_parameter const &param = params[0];
+
+    vector<ffm_parameter> model_params(nr_models, param);
+    vector<shared_ptr<ffm_model>> models(nr_models);
+    vector<unique_ptr<UndoLog>> undo(nr_models);
+    for(ffm_int i = 0; i < nr_models; i++)
+    {
+        model_params[i].eta = params[i].eta;
+        model_params[i].lambda = params[i].lambda;
+        model_params[i].k = params[i].k;
+        models[i] = shared_ptr<ffm_model>(init_model(tr->n, tr->m, model_params[i]),
+            [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+    }
+
+    vector<ffm_float> R_tr, R_va;
+    if(param.normalization)
+    {
+        R_tr = normalize(*tr, param.nr_threads);
+        if(va != nullptr)
+            R_va = normalize(*va, param.nr_threads);
+    }
+    else
+    {
+        R_tr = vector<ffm_float>(tr->l, 1);
+        if(va != nullptr)
+            R_va = vector<ffm_float>(va->l, 1);
+    }
+
+    bool validate = va != nullptr && va->l != 0;
+    bool auto_stop = param.auto_stop && validate;
+    if(auto_stop)
+        for(ffm_int i = 0; i < nr_models; i++)
+            undo[i].reset(new UndoLog((ffm_long)tr->n*tr->m, models[i]->k*2));
+
+    vector<ffm_int> order(tr->l);
+    iota(order.begin(), order.end(), 0);
+
+    vector<bool> active(nr_models, true);
+    vector<ffm_double> best_va_loss(nr_models, numeric_limits<ffm_double>::max());
+    for(ffm_int i = 0; i < nr_models; i++)
+    {
+        results[i].model = nullptr;
+        results[i].nr_iters = 0;
+        results[i].tr_loss = 0;
+        results[i].va_loss = 0;
+    }
+
+    if(!param.quiet)
+    {
+        if(param.auto_stop && !validate)
+            cerr << "warning: ignoring auto-stop because there is no validation set" << endl;
+
+        cout.width(4);
+        cout << "iter";
+        cout.width(6);
+        cout << "model";
+        cout.width(13);
+        cout << "tr_logloss";
+        if(validate)
+        {
+            cout.width(13);
+            cout << "va_logloss";
+        }
+        cout << endl;
+    }
+
+    for(ffm_int iter = 1; iter <= param.nr_iters; iter++)
+    {
+        if(param.random)
+            shuffle_order(order, param.block_size);
+
+        vector<ffm_int> training;
+        for(ffm_int i = 0; i < nr_models; i++)
+            if(active[i])
+                training.push_back(i);
+        if(training.empty())
+            break;
+
+        // One row of losses per thread, summed after the parallel region.
+        vector<ffm_double> thread_losses((ffm_long)param.nr_threads*nr_models, 0);
+
+#if defined USEOMP
+#pragma omp parallel num_threads(param.nr_threads)
+#endif
+        {
+            ffm_int tid = get_thread_num();
+            ffm_int nt = get_num_threads();
+
+            ffm_int ii_begin = (ffm_long)order.size()*tid/nt;
+            ffm_int ii_end = (ffm_long)order.size()*(tid+1)/nt;
+            ffm_double *losses = thread_losses.data() + (ffm_long)tid*nr_models;
+
+            for(ffm_int ii = ii_begin; ii < ii_end; ii += kBlockSize)
+                for(ffm_int i : training)
+                    losses[i] += train_range(get_rows(*tr), tr->Y, R_tr.data(), order.data(), 
+                                             ii, min(ii+kBlockSize, ii_end), *models[i], 
+                                             model_params[i], undo[i].get());
+        }
+
+        for(ffm_int i : training)
+        {
+            ffm_double tr_loss = 0;
+            for(ffm_int t = 0; t < param.nr_threads; t++)
+                tr_loss += thread_losses[(ffm_long)t*nr_models+i];
+            tr_loss /= tr->l;
+
+            if(!param.quiet)
+            {
+                cout.width(4);
+                cout << iter;
+                cout.width(6);
+                cout << i+1;
+                cout.width(13);
+                cout << fixed << setprecision(5) << tr_loss;
+            }
+
+            if(!validate)
+            {
+                results[i].nr_iters = iter;
+                results[i].tr_loss = tr_loss;
+                if(!param.quiet)
+                    cout << endl;
+                continue;
+            }
+
+            ffm_double va_loss = 0;
+#if defined USEOMP
+#pragma omp parallel num_threads(param.nr_threads) reduction(+: va_loss)
+#endif
+            {
+                ffm_int tid = get_thread_num();
+                ffm_int nt = get_num_threads();
+
+                va_loss += evaluate_range(get_rows(*va), va->Y, R_va.data(), 
+                                          (ffm_long)va->l*tid/nt, (ffm_long)va->l*(tid+1)/nt, 
+                                          *models[i], model_params[i]);
+            }
+            va_loss /= va->l;
+
+            if(!param.quiet)
+            {
+                cout.width(13);
+                cout << fixed << setprecision(5) << va_loss;
+            }
+
+            if(auto_stop && va_loss > best_va_loss[i])
+            {
+                undo[i]->rollback(models[i]->W);
+                undo[i].reset();
+                active[i] = false;
+                if(!param.quiet)
+                    cout << "  auto-stop, use model at " << iter-1 << "th iteration";
+            }
+            else
+            {
+                if(auto_stop)
+                    undo[i]->commit();
+                best_va_loss[i] = va_loss;
+                results[i].nr_iters = iter;
+                results[i].tr_loss = tr_loss;
+                results[i].va_loss = va_loss;
+            }
+
+            if(!param.quiet)
+                cout << endl;
+        }
+    }
+
+    for(ffm_int i = 0; i < nr_models; i++)
+        shrink_model(*models[i], model_params[i].k);
+
+    return models;
+}
+
+// A chunk of the binary file written by ffm_read_problem_to_disk: l, flags,
+// Y, R and P, then the nodes in compact form, i.e. the fields (a byte each,
+// or an ffm_int each with kCHUNK_WIDE_FIELDS), the feature indices, and the
+// values unless all of them are 1 (kCHUNK_BINARY). A chunk with l = 0 ends
+// the file.
+ffm_int const kCHUNK_BINARY = 1;
+ffm_int const kCHUNK_WIDE_FIELDS = 2;
+
+inline ffm_long get_chunk_node_size(ffm_int flags)
+{
+    ffm_long size = sizeof(ffm_uint);
+    size += (flags & kCHUNK_WIDE_FIELDS)? sizeof(ffm_int) : sizeof(unsigned char);
+    if(!(flags & kCHUNK_BINARY))
+        size += sizeof(ffm_float);
+    return size;
+}
+
+struct Chunk
+{
+    ffm_int l;
+    ffm_int flags;
+    vector<ffm_float> Y;
+    vector<ffm_float> R;
+    vector<ffm_long> P;
+    vector<unsigned char> F;
+    vector<ffm_uint> I;
+    vector<ffm_float> V;
+    vector<ffm_int> F_wide;
+    vector<ffm_node> X;
+
+    // Read the chunk at the current position of f. Returns false at the end
+    // of the file. Chunks with wide fields are expanded to nodes.
+    bool read(FILE *f)
+    {
+        l = 0;
+        flags = 0;
+        if(fread(&l, sizeof(ffm_int), 1, f) != 1 || l == 0)
+            return false;
+        fread(&flags, sizeof(ffm_int), 1, f);
+
+        Y.resize(l);
+        fread(Y.data(), sizeof(ffm_float), l, f);
+
+        R.resize(l);
+        fread(R.data(), sizeof(ffm_float), l, f);
+
+        P.resize(l+1);
+        fread(P.data(), sizeof(ffm_long), l+1, f);
+
+        ffm_long nnz = P[l];
+        if(flags & kCHUNK_WIDE_FIELDS)
+        {
+            F_wide.resize(nnz);
+            fread(F_wide.data(), sizeof(ffm_int), nnz, f);
+        }
+        else
+        {
+            F.resize(nnz);
+            fread(F.data(), sizeof(unsigned char), nnz, f);
+        }
+
+        I.resize(nnz);
+        fread(I.data(), sizeof(ffm_uint), nnz, f);
+
+        if(!(flags & kCHUNK_BINARY))
+        {
+            V.resize(nnz);
+            fread(V.data(), sizeof(ffm_float), nnz, f);
+        }
+
+        X.clear();
+        if(flags & kCHUNK_WIDE_FIELDS)
+        {
+            X.resize(nnz);
+            for(ffm_long p = 0; p < nnz; p++)
+            {
+                X[p].f = F_wide[p];
+                X[p].j = I[p];
+                X[p].v = (flags & kCHUNK_BINARY)? 1 : V[p];
+            }
+        }
+
+        return true;
+    }
+
+    Rows rows() const
+    {
+        Rows rows = {X.data(), F.data(), I.data(), V.data(), P.data()};
+        if(!(flags & kCHUNK_WIDE_FIELDS))
+            rows.X = nullptr;
+        if(flags & kCHUNK_BINARY)
+            rows.V = nullptr;
+        return rows;
+    }
+};
+
+// Header of the binary files written by ffm_read_problem_to_disk. Besides
+// the sizes needed for training, it identifies the text file the data was
+// converted from (path, size, modification time and a fingerprint of its
+// content), so that an up-to-date conversion can be reused.
+char const kBIN_MAGIC[4] = {'F', 'F', 'M', 'D'};
+ffm_int const kBIN_VERSION = 1;
+
+struct BinHeader
+{
+    ffm_int m;
+    ffm_int n;
+    ffm_int max_l;
+    ffm_long max_nnz;
+    string src_path;
+    ffm_long src_size;
+    ffm_long src_mtime;
+    ffm_long src_fingerprint;
+};
+
+// FNV-1a hash of the size and of 64 blocks of 4KB spread evenly over the
+// file. It reads at most 256KB, whatever the size of the file.
+ffm_long get_fingerprint(FILE *f, ffm_long size)
+{
+    ffm_int const kNR_SAMPLES = 64;
+    ffm_long const kSAMPLE_SIZE = 4096;
+
+    unsigned long long hash = 14695981039346656037ULL;
+    auto update = [&] (unsigned char const *data, size_t length)
+    {
+        for(size_t i = 0; i < length; i++)
+        {
+            hash ^= data[i];
+            hash *= 1099511628211ULL;
+        }
+    };
+
+    update((unsigned char const*)&size, sizeof(size));
+
+    vector<unsigned char> block(kSAMPLE_SIZE);
+    ffm_long last = max(size-kSAMPLE_SIZE, 0LL);
+    for(ffm_int s = 0; s < kNR_SAMPLES; s++)
+    {
+        fseek(f, (long)(last*s/(kNR_SAMPLES-1)), SEEK_SET);
+        size_t length = fread(block.data(), 1, kSAMPLE_SIZE, f);
+        update(block.data(), length);
+    }
+
+    return (ffm_long)hash;
+}
+
+// Fill in the src_ fields of header for the text file at path.
+bool get_source_info(char const *path, BinHeader &header)
+{
+#ifndef _WIN32
+    char resolved[PATH_MAX];
+    if(realpath(path, resolved) == nullptr)
+        return false;
+    header.src_path = resolved;
+
+    struct stat st;
+    if(stat(path, &st) != 0)
+        return false;
+    header.src_mtime = st.st_mtime;
+#else
+    header.src_path = path;
+    header.src_mtime = 0;
+#endif
+
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return false;
+    fseek(f, 0, SEEK_END);
+    header.src_size = ftell(f);
+    header.src_fingerprint = get_fingerprint(f, header.src_size);
+    fclose(f);
+
+    return true;
+}
+
+void write_bin_header(FILE *f, BinHeader const &header)
+{
+    ffm_int path_length = (ffm_int)header.src_path.size();
+
+    fwrite(kBIN_MAGIC, 1, sizeof(kBIN_MAGIC), f);
+    fwrite(&kBIN_VERSION, sizeof(ffm_int), 1, f);
+    fwrite(&header.m, sizeof(ffm_int), 1, f);
+    fwrite(&header.n, sizeof(ffm_int), 1, f);
+    fwrite(&header.max_l, sizeof(ffm_int), 1, f);
+    fwrite(&header.max_nnz, sizeof(ffm_long), 1, f);
+    fwrite(&header.src_size, sizeof(ffm_long), 1, f);
+    fwrite(&header.src_mtime, sizeof(ffm_long), 1, f);
+    fwrite(&header.src_fingerprint, sizeof(ffm_long), 1, f);
+    fwrite(&path_length, sizeof(ffm_int), 1, f);
+    fwrite(header.src_path.data(), 1, path_length, f);
+}
+
+// Read the header at the beginning of f, and leave f at the first chunk.
+bool read_bin_header(FILE *f, BinHeader &header)
+{
+    char magic[sizeof(kBIN_MAGIC)];
+    ffm_int version = 0, path_length = 0;
+
+    rewind(f);
+    bool ok = 
+        fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+        memcmp(magic, kBIN_MAGIC, sizeof(magic)) == 0 &&
+        fread(&version, sizeof(ffm_int), 1, f) == 1 &&
+        version == kBIN_VERSION &&
+        fread(&header.m, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&header.n, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&header.max_l, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&header.max_nnz, sizeof(ffm_long), 1, f) == 1 &&
+        fread(&header.src_size, sizeof(ffm_long), 1, f) == 1 &&
+        fread(&header.src_mtime, sizeof(ffm_long), 1, f) == 1 &&
+        fread(&header.src_fingerprint, sizeof(ffm_long), 1, f) == 1 &&
+        fread(&path_length, sizeof(ffm_int), 1, f) == 1 &&
+        path_length >= 0;
+    if(!ok)
+        return false;
+
+    header.src_path.resize(path_length);
+    return fread(&header.src_path[0], 1, path_length, f) == (size_t)path_length;
+}
+
+// Offsets of the chunks of a binary file, so that they can be visited in any
+// order. If chunk_begins is given, it receives the index of the first
+// instance of each chunk, followed by the number of instances.
+vector<long> get_chunk_offsets(FILE *f, vector<ffm_long> *chunk_begins=nullptr)
+{
+    vector<long> offsets;
+    BinHeader header;
+    read_bin_header(f, header);
+    while(true)
+    {
+        long offset = ftell(f);
+        ffm_int l, flags;
+        if(fread(&l, sizeof(ffm_int), 1, f) != 1 || l == 0)
+            break;
+        fread(&flags, sizeof(ffm_int), 1, f);
+        offsets.push_back(offset);
+        if(chunk_begins != nullptr)
+            chunk_begins->push_back(l);
+
+        ffm_long nnz;
+        fseek(f, 2*l*sizeof(ffm_float) + l*sizeof(ffm_long), SEEK_CUR);
+        fread(&nnz, sizeof(ffm_long), 1, f);
+        fseek(f, nnz*get_chunk_node_size(flags), SEEK_CUR);
+    }
+
+    if(chunk_begins != nullptr)
+    {
+        chunk_begins->push_back(0);
+        rotate(chunk_begins->begin(), chunk_begins->end()-1, chunk_begins->end());
+        partial_sum(chunk_begins->begin(), chunk_begins->end(), chunk_begins->begin());
+    }
+
+    return offsets;
+}
+
+// Reads the chunks of a binary file one ahead of the consumer: while the
+// chunk returned by next() is used, a background thread reads the following
+// one into the other buffer. The two buffers are reused, so after the first
+// pass no memory is allocated.
+class ChunkReader
+{
+public:
+    explicit ChunkReader(FILE *f) : f(f), pos(0) {}
+    ~ChunkReader() { wait(); }
+
+    void reserve(ffm_int max_l, ffm_long max_nnz)
+    {
+        for(Chunk &chunk : buffers)
+        {
+            chunk.Y.reserve(max_l);
+            chunk.R.reserve(max_l);
+            chunk.P.reserve(max_l+1);
+            chunk.F.reserve(max_nnz);
+            chunk.I.reserve(max_nnz);
+        }
+    }
+
+    // Start reading the chunks at offsets, in this order.
+    void start(vector<long> const &offsets_)
+    {
+        wait();
+        offsets = offsets_;
+        pos = 0;
+        if(!offsets.empty())
+            reader = thread(&ChunkReader::read, this, offsets[0]);
+    }
+
+    // Wait for the next chunk. Returns a nullptr after the last one. The
+    // chunk stays valid until the following call.
+    Chunk* next()
+    {
+        if(pos >= offsets.size())
+            return nullptr;
+
+        wait();
+        swap(buffers[0], buffers[1]);
+        pos++;
+        if(pos < offsets.size())
+            reader = thread(&ChunkReader::read, this, offsets[pos]);
+
+        return &buffers[0];
+    }
+
+    // Whether the last chunk has been handed out or is being read.
+    bool exhausted() const { return pos+1 >= offsets.size(); }
+
+private:
+    void read(long offset)
+    {
+        fseek(f, offset, SEEK_SET);
+        buffers[1].read(f);
+    }
+
+    void wait()
+    {
+        if(reader.joinable())
+            reader.join();
+    }
+
+    FILE *f;
+    vector<long> offsets;
+    size_t pos;
+    Chunk buffers[2];
+    thread reader;
+};
+
+// TODO: This function will be merged with train().
+//
+// If fold_of is given, the instances i with (*fold_of)[i] == fold are held
+// out, for cross-validation. If init is given, training continues from it, and
+// changed is set to the updated rows, as in train().
+shared_ptr<ffm_model> train_on_disk(
+    string tr_path,
+    string va_path,
+    ffm_parameter param,
+    vector<ffm_int> const *fold_of=nullptr,
+    ffm_int fold=-1,
+    ffm_model const *init=nullptr,
+    bool shrink=true,
+    unique_ptr<RowTracker> *changed=nullptr)
+{
+    FILE *f_tr = fopen(tr_path.c_str(), "rb");
+    FILE *f_va = nullptr;
+    if(!va_path.empty())
+        f_va = fopen(va_path.c_str(), "rb");
+
+    BinHeader header;
+    read_bin_header(f_tr, header);
+    ffm_int m = header.m, n = header.n, max_l = header.max_l;
+    ffm_long max_nnz = header.max_nnz;
+
+    shared_ptr<ffm_model> model = 
+        shared_ptr<ffm_model>(init != nullptr? init_model(n, m, param, *init) : init_model(n, m, param),
+            [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+
+    if(changed != nullptr)
+        changed->reset(new RowTracker((ffm_long)model->n*model->m));
+    RowTracker *tracker = changed != nullptr? changed->get() : nullptr;
+
+    vector<ffm_long> chunk_begins;
+    vector<long> chunk_offsets = get_chunk_offsets(f_tr, &chunk_begins);
+    vector<ffm_int> chunk_order(chunk_offsets.size());
+    iota(chunk_order.begin(), chunk_order.end(), 0);
+    vector<long> va_chunk_offsets;
+    if(f_va != nullptr)
+        va_chunk_offsets = get_chunk_offsets(f_va);
+
+    vector<ffm_int> order;
+
+    // Negatives are sampled as in train().
+    ffm_float neg_weight = param.neg_sample_rate < 1? 1/param.neg_sample_rate : 1;
+
+    // Chunks are read in the background while the previous one is trained
+    // on (or evaluated).
+    ChunkReader tr_reader(f_tr);
+    tr_reader.reserve(max_l, max_nnz);
+    ChunkReader va_reader(f_va);
+
+    bool auto_stop = param.auto_stop && !va_path.empty();
+
+    ffm_int k_aligned = (ffm_int)ceil((ffm_double)param.k/kALIGN)*kALIGN;
+    ffm_double best_va_loss = numeric_limits<ffm_double>::max();
+
+    unique_ptr<UndoLog> undo;
+    if(auto_stop)
+        undo.reset(new UndoLog((ffm_long)model->n*model->m, k_aligned*2));
+
+    if(!param.quiet)
+    {
+        if(param.auto_stop && va_path.empty())
+            cerr << "warning: ignoring auto-stop because there is no validation set" << endl;
+        cout.width(4);
+        cout << "iter";
+        cout.width(13);
+        cout << "tr_logloss";
+        if(!va_path.empty())
+        {
+            cout.width(13);
+            cout << "va_logloss";
+        }
+        cout << endl;
+    }
+
+    for(ffm_int iter = 1; iter <= param.nr_iters; iter++)
+    {
+        ffm_double tr_loss = 0;
+
+        if(param.random)
+            random_shuffle(chunk_order.begin(), chunk_order.end());
+
+        vector<long> offsets;
+        for(ffm_int c : chunk_order)
+            offsets.push_back(chunk_offsets[c]);
+
+        bool validate = f_va != nullptr && (!param.quiet || auto_stop);
+        bool va_started = false;
+
+        tr_reader.start(offsets);
+
+        ffm_double tr_weight = 0;
+        for(ffm_int c : chunk_order)
+        {
+            Chunk *chunk = tr_reader.next();
+            ffm_long first = chunk_begins[c];
+
+            // Once the last training chunk is in memory, the disk can move on
+            // to the validation set.
+            if(validate && !va_started && tr_reader.exhausted())
+            {
+                va_reader.start(va_chunk_offsets);
+                va_started = true;
+            }
+
+            bool use_order = param.random || fold_of != nullptr || param.neg_sample_rate < 1;
+            if(use_order)
+            {
+                order.clear();
+                for(ffm_int i = 0; i < chunk->l; i++)
+                {
+                    if(fold_of != nullptr && (*fold_of)[first+i] == fold)
+                        continue;
+                    if(!keep_instance(chunk->Y[i], first+i, param.neg_sample_rate))
+                        continue;
+                    order.push_back(i);
+                    tr_weight += chunk->Y[i] > 0? 1 : neg_weight;
+                }
+                if(param.random)
+                    shuffle_order(order, param.block_size);
+            }
+            else
+            {
+                tr_weight += chunk->l;
+            }
+
+            ffm_int l = use_order? (ffm_int)order.size() : chunk->l;
+
+#if defined USEOMP
+#pragma omp parallel num_threads(param.nr_threads) reduction(+: tr_loss)
+#endif
+            {
+                ffm_int tid = get_thread_num();
+                ffm_int nt = get_num_threads();
+
+                tr_loss += train_range(chunk->rows(), chunk->Y.data(), 
+                                       param.normalization? chunk->R.data() : nullptr, 
+                                       use_order? order.data() : nullptr,
+                                       (ffm_long)l*tid/nt, (ffm_long)l*(tid+1)/nt, 
+                                       *model, param, undo.get(), tracker, neg_weight);
+            }
+        }
+
+        tr_loss /= tr_weight;
+
+        if(!param.quiet)
+        {
+            cout.width(4);
+            cout << iter;
+            cout.width(13);
+            cout << fixed << setprecision(5) << tr_loss;
+        }
+
+        if(validate)
+        {
+            if(!va_started)
+                va_reader.start(va_chunk_offsets);
+
+            ffm_int va_l = 0;
+            ffm_double va_loss = 0;
+            while(Chunk *va_chunk = va_reader.next())
+            {
+                ffm_int l = va_chunk->l;
+                va_l += l;
+
+#if defined USEOMP
+#pragma omp parallel num_threads(param.nr_threads) reduction(+: va_loss)
+#endif
+                {
+                    ffm_int tid = get_thread_num();
+                    ffm_int nt = get_num_threads();
+
+                    va_loss += evaluate_range(va_chunk->rows(), va_chunk->Y.data(), 
+                                              param.normalization? va_chunk->R.data() : nullptr,
+                                              (ffm_long)l*tid/nt, (ffm_long)l*(tid+1)/nt, 
+                                              *model, param);
+                }
+            }
+            va_loss /= va_l;
+
+            if(!param.quiet)
+            {
+                cout.width(13);
+                cout << fixed << setprecision(5) << va_loss;
+            }
+
+            if(auto_stop)
+            {
+                if(va_loss > best_va_loss)
+                {
+                    undo->rollback(model->W);
+                    if(!param.quiet)
+                        cout << endl << "Auto-stop. Use model at " << iter-1 << "th iteration." << endl;
+                    break;
+                }
+                else
+                {
+                    undo->commit();
+                    best_va_loss = va_loss; 
+                }
+            }
+        }
+
+        if(!param.quiet)
+            cout << endl;
+    }
+
+    if(shrink)
+        shrink_model(*model, param.k);
+
+    fclose(f_tr);
+    if(!va_path.empty())
+        fclose(f_va);
+
+    return model;
+}
+
+// Number of folds to train at the same time, at most one per thread. The
+// threads of param are split evenly over them.
+ffm_int split_threads(ffm_int nr_folds, ffm_parameter &param)
+{
+    ffm_int nr_concurrent = max(1, min(nr_folds, param.nr_threads));
+    param.nr_threads = max(1, param.nr_threads/nr_concurrent);
+
+    // Pinning applies to the whole process, so it cannot be shared by
+    // concurrent folds.
+    if(nr_concurrent > 1)
+        param.numa = false;
+
+    return nr_concurrent;
+}
+
+// Call run_fold(fold) for every fold, from nr_concurrent threads that each
+// take the next fold until none is left. Returns the results by fold.
+template<typename RunFold>
+vector<ffm_double> run_folds(ffm_int nr_folds, ffm_int nr_concurrent, RunFold run_fold)
+{
+    vector<ffm_double> losses(nr_folds, 0);
+    atomic<ffm_int> next_fold(0);
+
+    auto worker = [&] ()
+    {
+        for(ffm_int fold = next_fold++; fold < nr_folds; fold = next_fold++)
+            losses[fold] = run_fold(fold);
+    };
+
+    vector<thread> workers;
+    for(ffm_int t = 1; t < nr_concurrent; t++)
+        workers.push_back(thread(worker));
+    worker();
+    for(thread &t : workers)
+        t.join();
+
+    return losses;
+}
+
+void print_cv(vector<ffm_double> const &losses, vector<ffm_long> const &sizes, ffm_long l)
+{
+    cout.width(4);
+    cout << "fold";
+    cout.width(13);
+    cout << "logloss";
+    cout << endl;
+
+    ffm_double loss = 0;
+    for(size_t fold = 0; fold < losses.size(); fold++)
+    {
+        cout.width(4);
+        cout << fold;
+        cout.width(13);
+        cout << fixed << setprecision(4) << losses[fold] / sizes[fold];
+        cout << endl;
+
+        loss += losses[fold];
+    }
+
+    cout.width(17);
+    cout.fill('=');
+    cout << "" << endl;
+    cout.fill(' ');
+    cout.width(4);
+    cout << "avg";
+    cout.width(13);
+    cout << fixed << setprecision(4) << loss/l;
+    cout << endl;
+}
+
+// Sum of the logloss of the instances in X, P, Y, scored in one batch by the
+// vectorized kernel. R may be a nullptr.
+ffm_double batch_loss(
+    vector<ffm_node> &X, 
+    vector<ffm_long> &P, 
+    vector<ffm_float> const &Y, 
+    ffm_float *R,
+    ffm_model &model, 
+    ffm_int nr_threads)
+{
+    ffm_int l = (ffm_int)Y.size();
+    vector<ffm_float> Y_bar(l);
+    ffm_predict_batch(X.data(), P.data(), R, l, &model, Y_bar.data(), nr_threads);
+
+    ffm_double loss = 0;
+    for(ffm_int i = 0; i < l; i++)
+        loss -= Y[i]==1? log(Y_bar[i]) : log(1-Y_bar[i]);
+
+    return loss;
+}
+
+// Sum of the logloss of the instances i of a binary file with
+// fold_of[i] == fold.
+ffm_double evaluate_fold_on_disk(
+    string path, 
+    ffm_model &model, 
+    vector<ffm_int> const &fold_of, 
+    ffm_int fold, 
+    ffm_int nr_threads)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+
+    vector<ffm_long> chunk_begins;
+    vector<long> chunk_offsets = get_chunk_offsets(f, &chunk_begins);
+
+    vector<ffm_node> X;
+    vector<ffm_long> P;
+    vector<ffm_float> Y, R;
+
+    ffm_double loss = 0;
+    {
+        ChunkReader reader(f);
+        reader.start(chunk_offsets);
+        for(size_t c = 0; c < chunk_offsets.size(); c++)
+        {
+            Chunk *chunk = reader.next();
+            Rows rows = chunk->rows();
+
+            X.clear();
+            P.assign(1, 0);
+            Y.clear();
+            R.clear();
+            for(ffm_int i = 0; i < chunk->l; i++)
+            {
+                if(fold_of[chunk_begins[c]+i] != fold)
+                    continue;
+                get_nodes(rows, i, X);
+                P.push_back(X.size());
+                Y.push_back(chunk->Y[i]);
+                R.push_back(chunk->R[i]);
+            }
+
+            loss += batch_loss(X, P, Y, R.data(), model, nr_threads);
+        }
+    }
+
+    fclose(f);
+
+    return loss;
+}
+
+#if defined __linux__
+// Data-parallel training over processes on one machine, standing in for a
+// cluster. Each worker process owns a contiguous shard of the training set;
+// each server process owns the rows of the features j with
+// j % nr_servers == s, i.e. the features are hash-partitioned by their id.
+// They talk over Unix socket pairs:
+//
+//   worker -> server  PULL  features[count]; the server replies with their
+//                           rows (all m fields, weights and accumulators)
+//   worker -> server  PUSH  features[count], then the changes of their rows
+//   coordinator -> *  EPOCH, GATHER, STOP
+//
+// A worker trains on batches of kPS_BATCH instances: it pulls the rows the
+// batch uses, trains the batch on its local copy with train_range, and pushes
+// the differences, which the server adds to its rows. Every message carries
+// the worker's clock, the number of batches it has finished over all
+// iterations. A server answers a PULL at clock c only when every worker has
+// pushed up to clock c-kPS_STALENESS, which bounds the staleness.
+ffm_int const kPS_BATCH = 64;
+ffm_long const kPS_STALENESS = 4;
+
+enum { kPS_PULL, kPS_PUSH, kPS_EPOCH, kPS_GATHER, kPS_STOP };
+
+struct PSHeader
+{
+    ffm_int type;
+    ffm_int count;
+    ffm_long clock;
+};
+
+// Write to a socket; a peer that has gone away is an error, not a SIGPIPE.
+bool write_all(int fd, void const *data, size_t size)
+{
+    char const *ptr = (char const*)data;
+    while(size > 0)
+    {
+        ssize_t written = send(fd, ptr, size, MSG_NOSIGNAL);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            return false;
+        ptr += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool read_all(int fd, void *data, size_t size)
+{
+    char *ptr = (char*)data;
+    while(size > 0)
+    {
+        ssize_t nr_read = read(fd, ptr, size);
+        if(nr_read < 0 && errno == EINTR)
+            continue;
+        if(nr_read <= 0)
+            return false;
+        ptr += nr_read;
+        size -= nr_read;
+    }
+    return true;
+}
+
+bool send_message(int fd, ffm_int type, ffm_int count, ffm_long clock)
+{
+    PSHeader header = {type, count, clock};
+    return write_all(fd, &header, sizeof(header));
+}
+
+// Number of features owned by server s.
+ffm_int get_nr_owned(ffm_int n, ffm_int s, ffm_int nr_servers)
+{
+    return (n-s+nr_servers-1)/nr_servers;
+}
+
+void run_server(
+    ffm_int s,
+    ffm_int nr_servers,
+    ffm_int n,
+    ffm_int m,
+    ffm_parameter const &param,
+    vector<int> const &worker_fds,
+    int coordinator_fd)
+{
+    ffm_int k_aligned = (ffm_int)ceil((ffm_double)param.k/kALIGN)*kALIGN;
+    ffm_long feature_size = (ffm_long)m*k_aligned*2;
+    ffm_int nr_workers = (ffm_int)worker_fds.size();
+
+    // The owned rows start as in init_model, so that the full model does not
+    // depend on the number of servers.
+    vector<ffm_float> W((ffm_long)get_nr_owned(n, s, nr_servers)*feature_size);
+    {
+        ffm_float coef = 1.0f/sqrt(param.k);
+        default_random_engine generator;
+        uniform_real_distribution<ffm_float> distribution(0.0, 1.0);
+        for(ffm_int j = 0; j < n; j++)
+        {
+            bool mine = j%nr_servers == s;
+            ffm_long offset = mine? (ffm_long)(j/nr_servers)*feature_size : 0;
+            for(ffm_int f = 0; f < m; f++, offset += 2*k_aligned)
+            {
+                for(ffm_int d = 0; d < param.k; d++)
+                {
+                    ffm_float value = coef*distribution(generator);
+                    if(mine)
+                        W[offset+d] = value;
+                }
+                if(mine)
+                    fill(W.begin()+offset+k_aligned, W.begin()+offset+2*k_aligned, 1.0f);
+            }
+        }
+    }
+
+    struct Pull
+    {
+        ffm_int worker;
+        ffm_long clock;
+        vector<ffm_int> features;
+    };
+    vector<Pull> waiting;
+    vector<ffm_long> clocks(nr_workers, 0);
+
+    // A GATHER at clock c waits for all pushes up to c, like a PULL with no
+    // staleness. Both return false if the peer has gone away.
+    ffm_long gather_clock = -1;
+    auto try_gather = [&] ()
+    {
+        if(gather_clock < 0 || *min_element(clocks.begin(), clocks.end()) < gather_clock)
+            return true;
+        gather_clock = -1;
+        return write_all(coordinator_fd, W.data(), W.size()*sizeof(ffm_float));
+    };
+
+    auto reply = [&] (Pull const &pull)
+    {
+        for(ffm_int j : pull.features)
+            if(!write_all(worker_fds[pull.worker], W.data() + (ffm_long)(j/nr_servers)*feature_size, 
+                          feature_size*sizeof(ffm_float)))
+                return false;
+        return true;
+    };
+
+    auto ready = [&] (Pull const &pull)
+    {
+        return *min_element(clocks.begin(), clocks.end()) >= pull.clock-kPS_STALENESS;
+    };
+
+    vector<pollfd> fds(nr_workers+1);
+    for(ffm_int w = 0; w < nr_workers; w++)
+        fds[w].fd = worker_fds[w];
+    fds[nr_workers].fd = coordinator_fd;
+    for(pollfd &fd : fds)
+        fd.events = POLLIN;
+
+    vector<ffm_int> features;
+    vector<ffm_float> deltas;
+    while(true)
+    {
+        if(poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+
+        if(fds[nr_workers].revents != 0)
+        {
+            PSHeader header;
+            if(!read_all(coordinator_fd, &header, sizeof(header)) || header.type == kPS_STOP)
+                return;
+            if(header.type == kPS_GATHER)
+            {
+                gather_clock = header.clock;
+                if(!try_gather())
+                    return;
+            }
+        }
+
+        for(ffm_int w = 0; w < nr_workers; w++)
+        {
+            if(fds[w].revents == 0)
+                continue;
+
+            PSHeader header;
+            if(!read_all(worker_fds[w], &header, sizeof(header)))
+                return;
+
+            features.resize(header.count);
+            if(!read_all(worker_fds[w], features.data(), features.size()*sizeof(ffm_int)))
+                return;
+
+            if(header.type == kPS_PULL)
+            {
+                Pull pull = {w, header.clock, features};
+                if(!ready(pull))
+                    waiting.push_back(pull);
+                else if(!reply(pull))
+                    return;
+            }
+            else if(header.type == kPS_PUSH)
+            {
+                deltas.resize(features.size()*feature_size);
+                if(!read_all(worker_fds[w], deltas.data(), deltas.size()*sizeof(ffm_float)))
+                    return;
+                for(size_t i = 0; i < features.size(); i++)
+                {
+                    ffm_float *row = W.data() + (ffm_long)(features[i]/nr_servers)*feature_size;
+                    ffm_float const *delta = deltas.data() + i*feature_size;
+                    for(ffm_long d = 0; d < feature_size; d++)
+                        row[d] += delta[d];
+                }
+
+                clocks[w] = header.clock;
+                auto last = partition(waiting.begin(), waiting.end(), [&] (Pull const &pull) { return !ready(pull); });
+                for(auto it = last; it != waiting.end(); it++)
+                    if(!reply(*it))
+                        return;
+                waiting.erase(last, waiting.end());
+                if(!try_gather())
+                    return;
+            }
+        }
+    }
+}
+
+// Sum of the logloss of all instances of a binary file, for a model that is
+// still in training layout.
+ffm_double evaluate_on_disk(string const &path, ffm_model &model, ffm_parameter const &param)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    vector<long> chunk_offsets = get_chunk_offsets(f);
+
+    ffm_double loss = 0;
+    {
+        ChunkReader reader(f);
+        reader.start(chunk_offsets);
+        while(Chunk *chunk = reader.next())
+        {
+            ffm_int l = chunk->l;
+#if defined USEOMP
+#pragma omp parallel num_threads(param.nr_threads) reduction(+: loss)
+#endif
+            {
+                ffm_int tid = get_thread_num();
+                ffm_int nt = get_num_threads();
+
+                loss += evaluate_range(chunk->rows(), chunk->Y.data(), 
+                                       param.normalization? chunk->R.data() : nullptr,
+                                       (ffm_long)l*tid/nt, (ffm_long)l*(tid+1)/nt, 
+                                       model, param);
+            }
+        }
+    }
+
+    fclose(f);
+
+    return loss;
+}
+
+// The instances [begin, end) of the binary file at path, as nodes.
+void read_shard(
+    string const &path, 
+    ffm_long begin, 
+    ffm_long end,
+    vector<ffm_node> &X,
+    vector<ffm_long> &P,
+    vector<ffm_float> &Y,
+    vector<ffm_float> &R)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    vector<ffm_long> chunk_begins;
+    vector<long> chunk_offsets = get_chunk_offsets(f, &chunk_begins);
+
+    P.assign(1, 0);
+    Chunk chunk;
+    for(size_t c = 0; c < chunk_offsets.size(); c++)
+    {
+        if(chunk_begins[c+1] <= begin || chunk_begins[c] >= end)
+            continue;
+
+        fseek(f, chunk_offsets[c], SEEK_SET);
+        chunk.read(f);
+        Rows rows = chunk.rows();
+        for(ffm_int i = 0; i < chunk.l; i++)
+        {
+            ffm_long index = chunk_begins[c]+i;
+            if(index < begin || index >= end)
+                continue;
+            get_nodes(rows, i, X);
+            P.push_back(X.size());
+            Y.push_back(chunk.Y[i]);
+            R.push_back(chunk.R[i]);
+        }
+    }
+
+    fclose(f);
+}
+
+void run_worker(
+    ffm_int n,
+    ffm_int m,
+    ffm_parameter const &param,
+    vector<ffm_node> const &X,
+    vector<ffm_long> const &P,
+    vector<ffm_float> const &Y,
+    vector<ffm_float> const &R,
+    vector<int> const &server_fds,
+    int coordinator_fd)
+{
+    ffm_int k_aligned = (ffm_int)ceil((ffm_double)param.k/kALIGN)*kALIGN;
+    ffm_long feature_size = (ffm_long)m*k_aligned*2;
+    ffm_int nr_servers = (ffm_int)server_fds.size();
+    ffm_int l = (ffm_int)Y.size();
+
+    ffm_long max_nnz = 0;
+    for(ffm_int i = 0; i < l; i++)
+        max_nnz = max(max_nnz, P[i+1]-P[i]);
+    ffm_long max_features = min((ffm_long)n, kPS_BATCH*max_nnz);
+
+    // The batch is renumbered to local features 0, 1, ..., so that the
+    // pulled rows form a small model that train_range works on as usual.
+    ffm_model local;
+    local.m = m;
+    local.k = k_aligned;
+    local.normalization = param.normalization;
+    local.J = nullptr;
+    local.mask = make_mask(m, param.pair_mask);
+    local.W = malloc_aligned_float(max(max_features, 1LL)*feature_size);
+    vector<ffm_float> pulled(max(max_features, 1LL)*feature_size);
+
+    unordered_map<ffm_int, ffm_int> local_of;
+    vector<ffm_int> global_of;
+    vector<vector<ffm_int>> owned(nr_servers);
+    vector<ffm_node> batch_X;
+    vector<ffm_long> batch_P;
+    vector<ffm_float> batch_Y, batch_R, deltas;
+
+    vector<ffm_int> order(l);
+    iota(order.begin(), order.end(), 0);
+
+    // The worker gives up as soon as a peer has gone away; the coordinator
+    // then sees it go away in turn.
+    bool ok = true;
+    while(ok)
+    {
+        PSHeader header;
+        if(!read_all(coordinator_fd, &header, sizeof(header)) || header.type != kPS_EPOCH)
+            break;
+        ffm_long clock = header.clock;
+        ffm_long next_epoch = header.clock+header.count;
+
+        if(param.random)
+            shuffle_order(order, param.block_size);
+
+        ffm_double loss = 0;
+        for(ffm_int ii_begin = 0; ok && ii_begin < l; ii_begin += kPS_BATCH, clock++)
+        {
+            ffm_int ii_end = min(ii_begin+kPS_BATCH, l);
+
+            local_of.clear();
+            global_of.clear();
+            for(vector<ffm_int> &features : owned)
+                features.clear();
+            batch_X.clear();
+            batch_P.assign(1, 0);
+            batch_Y.clear();
+            batch_R.clear();
+            for(ffm_int ii = ii_begin; ii < ii_end; ii++)
+            {
+                ffm_int i = order[ii];
+                for(ffm_long p = P[i]; p < P[i+1]; p++)
+                {
+                    ffm_node N = X[p];
+                    if(N.j >= n || N.f >= m)
+                        continue;
+                    auto it = local_of.find(N.j);
+                    if(it == local_of.end())
+                    {
+                        it = local_of.insert(make_pair(N.j, (ffm_int)global_of.size())).first;
+                        global_of.push_back(N.j);
+                    }
+                    N.j = it->second;
+                    batch_X.push_back(N);
+                }
+                batch_P.push_back(batch_X.size());
+                batch_Y.push_back(Y[i]);
+                batch_R.push_back(R[i]);
+            }
+
+            // Rows are exchanged in the order of global_of within each server.
+            for(ffm_int j : global_of)
+                owned[j%nr_servers].push_back(j);
+
+            for(ffm_int s = 0; ok && s < nr_servers; s++)
+            {
+                vector<ffm_int> const &features = owned[s];
+                ok = send_message(server_fds[s], kPS_PULL, (ffm_int)features.size(), clock) &&
+                     write_all(server_fds[s], features.data(), features.size()*sizeof(ffm_int));
+                for(ffm_int j : features)
+                    ok = ok && read_all(server_fds[s], local.W + (ffm_long)local_of[j]*feature_size, 
+                                        feature_size*sizeof(ffm_float));
+            }
+            if(!ok)
+                break;
+
+            local.n = (ffm_int)global_of.size();
+            copy(local.W, local.W + local.n*feature_size, pulled.begin());
+
+            Rows rows = {batch_X.data(), nullptr, nullptr, nullptr, batch_P.data()};
+            loss += train_range(rows, batch_Y.data(), param.normalization? batch_R.data() : nullptr, 
+                                nullptr, 0, ii_end-ii_begin, local, param);
+
+            for(ffm_int s = 0; ok && s < nr_servers; s++)
+            {
+                vector<ffm_int> const &features = owned[s];
+                deltas.resize(features.size()*feature_size);
+                for(size_t i = 0; i < features.size(); i++)
+                {
+                    ffm_long offset = (ffm_long)local_of[features[i]]*feature_size;
+                    for(ffm_long d = 0; d < feature_size; d++)
+                        deltas[i*feature_size+d] = local.W[offset+d]-pulled[offset+d];
+                }
+                ok = send_message(server_fds[s], kPS_PUSH, (ffm_int)features.size(), clock+1) &&
+                     write_all(server_fds[s], features.data(), features.size()*sizeof(ffm_int)) &&
+                     write_all(server_fds[s], deltas.data(), deltas.size()*sizeof(ffm_float));
+            }
+        }
+
+        // Workers with fewer batches than others catch up to the end of the
+        // iteration, so that they do not hold back the others.
+        for(ffm_int s = 0; ok && s < nr_servers; s++)
+            ok = send_message(server_fds[s], kPS_PUSH, 0, next_epoch);
+
+        ok = ok && write_all(coordinator_fd, &loss, sizeof(loss));
+    }
+
+    free_aligned(local.W);
+    delete[] local.mask;
+}
+
+shared_ptr<ffm_model> train_distributed(
+    string tr_path,
+    string va_path,
+    ffm_int nr_workers,
+    ffm_int nr_servers,
+    ffm_parameter param)
+{
+    FILE *f_tr = fopen(tr_path.c_str(), "rb");
+    if(f_tr == nullptr)
+        return nullptr;
+    BinHeader header;
+    read_bin_header(f_tr, header);
+    ffm_int n = header.n, m = header.m;
+    vector<ffm_long> chunk_begins;
+    get_chunk_offsets(f_tr, &chunk_begins);
+    fclose(f_tr);
+
+    ffm_long l = chunk_begins.back();
+    ffm_long va_l = 0;
+    if(!va_path.empty())
+    {
+        FILE *f_va = fopen(va_path.c_str(), "rb");
+        if(f_va == nullptr)
+            return nullptr;
+        vector<ffm_long> va_chunk_begins;
+        get_chunk_offsets(f_va, &va_chunk_begins);
+        fclose(f_va);
+        va_l = va_chunk_begins.back();
+    }
+
+    // All iterations have as many batches as the largest shard.
+    ffm_long nr_batches = ((l+nr_workers-1)/nr_workers+kPS_BATCH-1)/kPS_BATCH;
+
+    // One socket pair between every worker and every server, and one between
+    // the coordinator (this process) and every other process.
+    vector<vector<int>> links(nr_workers, vector<int>(nr_servers*2));
+    vector<int> worker_links(nr_workers*2), server_links(nr_servers*2);
+    vector<int> all_fds;
+    bool ok = true;
+    for(ffm_int w = 0; w < nr_workers; w++)
+        for(ffm_int s = 0; s < nr_servers; s++)
+            ok = ok && socketpair(AF_UNIX, SOCK_STREAM, 0, &links[w][s*2]) == 0;
+    for(ffm_int w = 0; w < nr_workers; w++)
+        ok = ok && socketpair(AF_UNIX, SOCK_STREAM, 0, &worker_links[w*2]) == 0;
+    for(ffm_int s = 0; s < nr_servers; s++)
+        ok = ok && socketpair(AF_UNIX, SOCK_STREAM, 0, &server_links[s*2]) == 0;
+    if(!ok)
+        throw runtime_error("cannot create sockets");
+    for(vector<int> const &fds : links)
+        all_fds.insert(all_fds.end(), fds.begin(), fds.end());
+    all_fds.insert(all_fds.end(), worker_links.begin(), worker_links.end());
+    all_fds.insert(all_fds.end(), server_links.begin(), server_links.end());
+
+    // Start a child that keeps only the sockets in keep.
+    vector<pid_t> children;
+    auto spawn = [&] (vector<int> const &keep, function<void()> const &run)
+    {
+        cout << flush;
+        pid_t pid = fork();
+        if(pid < 0)
+            throw runtime_error("cannot create processes");
+        if(pid == 0)
+        {
+            for(int fd : all_fds)
+                if(find(keep.begin(), keep.end(), fd) == keep.end())
+                    close(fd);
+            run();
+            _exit(0);
+        }
+        children.push_back(pid);
+    };
+
+    for(ffm_int s = 0; s < nr_servers; s++)
+    {
+        vector<int> worker_fds;
+        for(ffm_int w = 0; w < nr_workers; w++)
+            worker_fds.push_back(links[w][s*2+1]);
+        int coordinator_fd = server_links[s*2+1];
+        vector<int> keep(worker_fds);
+        keep.push_back(coordinator_fd);
+        spawn(keep, [&] () { run_server(s, nr_servers, n, m, param, worker_fds, coordinator_fd); });
+    }
+
+    for(ffm_int w = 0; w < nr_workers; w++)
+    {
+        vector<int> server_fds;
+        for(ffm_int s = 0; s < nr_servers; s++)
+            server_fds.push_back(links[w][s*2]);
+        int coordinator_fd = worker_links[w*2+1];
+        vector<int> keep(server_fds);
+        keep.push_back(coordinator_fd);
+        spawn(keep, [&] ()
+        {
+            vector<ffm_node> X;
+            vector<ffm_long> P;
+            vector<ffm_float> Y, R;
+            read_shard(tr_path, l*w/nr_workers, l*(w+1)/nr_workers, X, P, Y, R);
+            run_worker(n, m, param, X, P, Y, R, server_fds, coordinator_fd);
+        });
+    }
+
+    for(vector<int> const &fds : links)
+        for(int fd : fds)
+            close(fd);
+    for(ffm_int w = 0; w < nr_workers; w++)
+        close(worker_links[w*2+1]);
+    for(ffm_int s = 0; s < nr_servers; s++)
+        close(server_links[s*2+1]);
+
+    shared_ptr<ffm_model> model = 
+        shared_ptr<ffm_model>(init_model(n, m, param),
+            [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+    ffm_long feature_size = (ffm_long)m*model->k*2;
+    ffm_long w_size = (ffm_long)n*feature_size;
+
+    // Stop the children and wait for them. After a failure they are killed,
+    // because some of them may be waiting for a peer that is still alive.
+    auto shut_down = [&] (bool failed)
+    {
+        if(failed)
+            for(pid_t pid : children)
+                kill(pid, SIGKILL);
+
+        // Servers stop as soon as a worker goes away, so they are stopped first.
+        for(ffm_int s = 0; s < nr_servers; s++)
+        {
+            send_message(server_links[s*2], kPS_STOP, 0, 0);
+            close(server_links[s*2]);
+        }
+        for(ffm_int w = 0; w < nr_workers; w++)
+        {
+            send_message(worker_links[w*2], kPS_STOP, 0, 0);
+            close(worker_links[w*2]);
+        }
+        for(pid_t pid : children)
+            waitpid(pid, nullptr, 0);
+
+        if(failed)
+            cerr << "a worker or server process has stopped" << endl;
+    };
+
+    // Copy the rows of all servers into model. Returns false if a server has
+    // gone away.
+    vector<ffm_float> slice;
+    auto gather = [&] (ffm_long clock)
+    {
+        for(ffm_int s = 0; s < nr_servers; s++)
+        {
+            slice.resize((ffm_long)get_nr_owned(n, s, nr_servers)*feature_size);
+            if(!send_message(server_links[s*2], kPS_GATHER, 0, clock) ||
+               !read_all(server_links[s*2], slice.data(), slice.size()*sizeof(ffm_float)))
+                return false;
+            for(ffm_int j = s; j < n; j += nr_servers)
+                copy(slice.begin() + (ffm_long)(j/nr_servers)*feature_size, 
+                     slice.begin() + (ffm_long)(j/nr_servers+1)*feature_size, 
+                     model->W + (ffm_long)j*feature_size);
+        }
+        return true;
+    };
+
+    bool validate = va_l != 0 && (!param.quiet || param.auto_stop);
+    bool auto_stop = param.auto_stop && va_l != 0;
+    ffm_double best_va_loss = numeric_limits<ffm_double>::max();
+    vector<ffm_float> best_W;
+
+    if(!param.quiet)
+    {
+        cout << nr_workers << " worker(s), " << nr_servers << " server(s)" << endl;
+        if(param.auto_stop && va_l == 0)
+            cerr << "warning: ignoring auto-stop because there is no validation set" << endl;
+        cout.width(4);
+        cout << "iter";
+        cout.width(13);
+        cout << "tr_logloss";
+        if(va_l != 0)
+        {
+            cout.width(13);
+            cout << "va_logloss";
+        }
+        cout << endl;
+    }
+
+    bool gathered = false;
+    ffm_int iter = 1;
+    for(; iter <= param.nr_iters; iter++)
+    {
+        bool ok = true;
+        for(ffm_int w = 0; w < nr_workers; w++)
+            ok = ok && send_message(worker_links[w*2], kPS_EPOCH, (ffm_int)nr_batches, (iter-1)*nr_batches);
+
+        ffm_double tr_loss = 0;
+        for(ffm_int w = 0; ok && w < nr_workers; w++)
+        {
+            ffm_double loss = 0;
+            ok = read_all(worker_links[w*2], &loss, sizeof(loss));
+            tr_loss += loss;
+        }
+        if(!ok)
+        {
+            shut_down(true);
+            return nullptr;
+        }
+        tr_loss /= l;
+        gathered = false;
+
+        if(!param.quiet)
+        {
+            cout.width(4);
+            cout << iter;
+            cout.width(13);
+            cout << fixed << setprecision(5) << tr_loss;
+        }
+
+        if(validate)
+        {
+            if(!gather(iter*nr_batches))
+            {
+                shut_down(true);
+                return nullptr;
+            }
+            gathered = true;
+
+            ffm_double va_loss = evaluate_on_disk(va_path, *model, param)/va_l;
+
+            if(!param.quiet)
+            {
+                cout.width(13);
+                cout << fixed << setprecision(5) << va_loss;
+            }
+
+            if(auto_stop)
+            {
+                if(va_loss > best_va_loss)
+                {
+                    copy(best_W.begin(), best_W.end(), model->W);
+                    if(!param.quiet)
+                        cout << endl << "Auto-stop. Use model at " << iter-1 << "th iteration." << endl;
+                    break;
+                }
+                best_W.assign(model->W, model->W+w_size);
+                best_va_loss = va_loss;
+            }
+        }
+
+        if(!param.quiet)
+            cout << endl;
+    }
+
+    if(!gathered && !gather((iter-1)*nr_batches))
+    {
+        shut_down(true);
+        return nullptr;
+    }
+
+    shut_down(false);
+
+    shrink_model(*model, param.k);
+
+    return model;
+}
+#endif
+
+// A text file mapped into memory, or read into memory where it cannot be
+// mapped.
+class TextFile
+{
+public:
+    explicit TextFile(char const *path) : data(nullptr), size(0), mapped(false), good(false)
+    {
+#ifndef _WIN32
+        int fd = open(path, O_RDONLY);
+        if(fd == -1)
+            return;
+
+        struct stat st;
+        if(fstat(fd, &st) == 0)
+        {
+            size = st.st_size;
+            if(size > 0)
+            {
+                void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(base != MAP_FAILED)
+                {
+                    data = (char const*)base;
+                    mapped = true;
+                }
+            }
+            good = size == 0 || mapped;
+        }
+        close(fd);
+        if(good)
+            return;
+#endif
+
+        FILE *f = fopen(path, "rb");
+        if(f == nullptr)
+            return;
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        rewind(f);
+        buffer.resize(size);
+        good = fread(buffer.data(), 1, size, f) == size;
+        fclose(f);
+        data = buffer.data();
+    }
+
+    ~TextFile()
+    {
+#ifndef _WIN32
+        if(mapped)
+            munmap((void*)data, size);
+#endif
+    }
+
+    bool ok() const { return good; }
+    char const *begin() const { return data; }
+    char const *end() const { return data+size; }
+
+private:
+    TextFile(TextFile const &);
+    TextFile& operator=(TextFile const &);
+
+    char const *data;
+    size_t size;
+    bool mapped;
+    bool good;
+    vector<char> buffer;
+};
+
+inline bool is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline ffm_int scan_int(char const *&p, char const *end)
+{
+    bool negative = false;
+    if(p != end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    ffm_long x = 0;
+    for(; p != end && *p >= '0' && *p <= '9'; p++)
+        x = x*10 + (*p-'0');
+
+    return (ffm_int)(negative? -x : x);
+}
+
+// Parse a float the way atof does. Numbers with at most 15 significant digits
+// and a small exponent are computed as mantissa*10^exponent in double
+// precision, which is exact up to the final rounding; anything else is
+// handed to strtod.
+inline ffm_float scan_float(char const *&p, char const *end)
+{
+    static ffm_double const pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    char const *begin = p;
+
+    bool negative = false;
+    if(p != end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    ffm_long mantissa = 0;
+    ffm_int nr_digits = 0, exponent = 0;
+    for(; p != end && *p >= '0' && *p <= '9'; p++, nr_digits++)
+        mantissa = mantissa*10 + (*p-'0');
+    if(p != end && *p == '.')
+        for(p++; p != end && *p >= '0' && *p <= '9'; p++, nr_digits++, exponent--)
+            mantissa = mantissa*10 + (*p-'0');
+    if(p != end && (*p == 'e' || *p == 'E'))
+    {
+        p++;
+        exponent += scan_int(p, end);
+    }
+
+    if(nr_digits <= 15 && exponent >= -22 && exponent <= 22 && 
+       (p == end || is_blank(*p) || *p == '\n'))
+    {
+        ffm_double x = (ffm_double)mantissa;
+        x = exponent < 0? x/pow10[-exponent] : x*pow10[exponent];
+        return (ffm_float)(negative? -x : x);
+    }
+
+    p = begin;
+    while(p != end && !is_blank(*p) && *p != '\n')
+        p++;
+    string token(begin, p);
+    return (ffm_float)strtod(token.c_str(), nullptr);
+}
+
+// Number of whitespace-separated tokens of a line.
+inline ffm_long count_tokens(char const *p, char const *end)
+{
+    ffm_long nr_tokens = 0;
+    bool in_token = false;
+    for(; p != end; p++)
+    {
+        bool blank = is_blank(*p);
+        if(!blank && !in_token)
+            nr_tokens++;
+        in_token = !blank;
+    }
+    return nr_tokens;
+}
+
+// Parse a line "<label> <field>:<index>:<value> ..." that has at least one
+// token. add(f, j, v) is called for each of the following tokens, and the
+// label is returned.
+template<typename Add>
+inline ffm_float scan_line(char const *p, char const *end, Add add)
+{
+    while(p != end && is_blank(*p))
+        p++;
+    ffm_float y = (scan_int(p, end)>0)? 1.0f : -1.0f;
+
+    while(true)
+    {
+        while(p != end && !is_blank(*p))
+            p++;
+        while(p != end && is_blank(*p))
+            p++;
+        if(p == end)
+            break;
+
+        ffm_int f = scan_int(p, end);
+        if(p != end && *p == ':')
+            p++;
+        ffm_int j = scan_int(p, end);
+        if(p != end && *p == ':')
+            p++;
+        ffm_float v = scan_float(p, end);
+
+        add(f, j, v);
+    }
+
+    return y;
+}
+
+// Call func(line_begin, line_end, nr_tokens) for each line of [begin, end)
+// that is not blank. The newline is not part of the line.
+template<typename Func>
+inline void for_each_line(char const *begin, char const *end, Func func)
+{
+    while(begin != end)
+    {
+        char const *nl = (char const*)memchr(begin, '\n', end-begin);
+        char const *line_end = nl != nullptr? nl : end;
+
+        ffm_long nr_tokens = count_tokens(begin, line_end);
+        if(nr_tokens > 0)
+            func(begin, line_end, nr_tokens);
+
+        begin = nl != nullptr? nl+1 : end;
+    }
+}
+
+// Split [begin, end) into nr_parts pieces of about the same size that start
+// at the beginning of a line.
+vector<char const*> split_lines(char const *begin, char const *end, ffm_int nr_parts)
+{
+    vector<char const*> bounds(1, begin);
+    for(ffm_int t = 1; t < nr_parts; t++)
+    {
+        char const *p = max(bounds.back(), begin + (end-begin)*t/nr_parts);
+        if(p != begin && p != end && p[-1] != '\n')
+        {
+            char const *nl = (char const*)memchr(p, '\n', end-p);
+            p = nl != nullptr? nl+1 : end;
+        }
+        bounds.push_back(p);
+    }
+    bounds.push_back(end);
+
+    return bounds;
+}
+
+inline ffm_int get_max_threads()
+{
+#if defined USEOMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// The instances of a piece of a text file, with the normalization factor of
+// each. P starts at 0.
+struct TextPart
+{
+    vector<ffm_float> Y;
+    vector<ffm_float> R;
+    vector<ffm_long> P;
+    vector<ffm_int> F;
+    vector<ffm_uint> I;
+    vector<ffm_float> V;
+    ffm_int m;
+    ffm_int n;
+
+    void parse(char const *begin, char const *end)
+    {
+        Y.clear();
+        R.clear();
+        P.assign(1, 0);
+        F.clear();
+        I.clear();
+        V.clear();
+        m = 0;
+        n = 0;
+
+        for_each_line(begin, end, [&] (char const *line, char const *line_end, ffm_long)
+        {
+            ffm_float scale = 0;
+            ffm_float y = scan_line(line, line_end, [&] (ffm_int f, ffm_int j, ffm_float v)
+            {
+                F.push_back(f);
+                I.push_back(j);
+                V.push_back(v);
+
+                m = max(m, f+1);
+                n = max(n, j+1);
+
+                scale += v*v;
+            });
+
+            Y.push_back(y);
+            R.push_back(1/scale);
+            P.push_back(I.size());
+        });
+    }
+};
+
+ffm_int const kSTREAM_RING_SIZE = 1<<16;
+ffm_int const kSTREAM_BATCH = 64;
+
+// A bounded ring of the lines read from a stream, filled by one reader and
+// drained in batches by the training threads. The strings are swapped in and
+// out, so once they have grown to the length of a line no more memory is
+// allocated. The ring also keeps the running sum of the progressive loss,
+// i.e. the loss of each instance before it is trained on.
+class LineRing
+{
+public:
+    LineRing() : lines(kSTREAM_RING_SIZE), head(0), tail(0), closed(false), nr_instances(0), loss(0) {}
+
+    // Blocks while the ring is full.
+    void push(string &line)
+    {
+        unique_lock<mutex> lock(mtx);
+        not_full.wait(lock, [&] { return head-tail < kSTREAM_RING_SIZE; });
+        swap(lines[head%kSTREAM_RING_SIZE], line);
+        head++;
+        not_empty.notify_one();
+    }
+
+    void close()
+    {
+        lock_guard<mutex> lock(mtx);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+    // Add the loss of the previous batch of a thread and take up to
+    // kSTREAM_BATCH lines into batch. Blocks while the ring is empty; returns
+    // false once it is closed and empty.
+    bool pop(vector<string> &batch, ffm_long batch_instances, ffm_double batch_loss)
+    {
+        unique_lock<mutex> lock(mtx);
+        nr_instances += batch_instances;
+        loss += batch_loss;
+
+        not_empty.wait(lock, [&] { return head != tail || closed; });
+        if(head == tail)
+            return false;
+
+        ffm_long size = min(head-tail, (ffm_long)kSTREAM_BATCH);
+        batch.resize(size);
+        for(ffm_long b = 0; b < size; b++, tail++)
+            swap(batch[b], lines[tail%kSTREAM_RING_SIZE]);
+        not_full.notify_one();
+
+        return true;
+    }
+
+    void get_progress(ffm_long &nr_instances_, ffm_double &loss_)
+    {
+        lock_guard<mutex> lock(mtx);
+        nr_instances_ = nr_instances;
+        loss_ = loss;
+    }
+
+private:
+    vector<string> lines;
+    ffm_long head, tail;
+    bool closed;
+    ffm_long nr_instances;
+    ffm_double loss;
+    mutex mtx;
+    condition_variable not_empty, not_full;
+};
+
+// Write model to path as a binary model with k weights per row, taking row r
+// from model.W + r*stride. With stride > k (training layout), the rows are
+// gathered through a buffer of fixed size rather than a copy of W.
+bool save_bin_model(ffm_model const &model, ffm_int k, ffm_long stride, char const *path)
+{
+    ffm_long const kBufferSize = 1<<20;
+
+    FILE *f = fopen(path, "wb");
+    if(f == nullptr)
+        return false;
+
+    ffm_int normalization = model.normalization;
+    ffm_long offset = kMODEL_PAYLOAD_OFFSET;
+    ffm_long nr_rows = (ffm_long)model.n*model.m;
+    ffm_long w_size = nr_rows*k;
+    ffm_long remap_offset = model.J != nullptr? offset + w_size*sizeof(ffm_float) : 0;
+    ffm_long mask_offset = 0;
+    if(model.mask != nullptr)
+        mask_offset = offset + w_size*sizeof(ffm_float) + (model.J != nullptr? model.n*sizeof(ffm_int) : 0);
+
+    fwrite(kMODEL_MAGIC, 1, sizeof(kMODEL_MAGIC), f);
+    fwrite(&kMODEL_VERSION, sizeof(ffm_int), 1, f);
+    fwrite(&model.n, sizeof(ffm_int), 1, f);
+    fwrite(&model.m, sizeof(ffm_int), 1, f);
+    fwrite(&k, sizeof(ffm_int), 1, f);
+    fwrite(&normalization, sizeof(ffm_int), 1, f);
+    fwrite(&offset, sizeof(ffm_long), 1, f);
+    fwrite(&remap_offset, sizeof(ffm_long), 1, f);
+    fwrite(&mask_offset, sizeof(ffm_long), 1, f);
+
+    vector<char> padding(offset-ftell(f), 0);
+    fwrite(padding.data(), 1, padding.size(), f);
+
+    if(stride == k)
+    {
+        fwrite(model.W, sizeof(ffm_float), w_size, f);
+    }
+    else
+    {
+        ffm_long rows_per_buffer = max((ffm_long)1, kBufferSize/k);
+        vector<ffm_float> buffer(rows_per_buffer*k);
+        for(ffm_long begin = 0; begin < nr_rows; begin += rows_per_buffer)
+        {
+            ffm_long end = min(nr_rows, begin+rows_per_buffer);
+            for(ffm_long row = begin; row < end; row++)
+            {
+                ffm_float const *src = model.W + row*stride;
+                copy(src, src+k, buffer.begin() + (row-begin)*k);
+            }
+            fwrite(buffer.data(), sizeof(ffm_float), (end-begin)*k, f);
+        }
+    }
+
+    if(model.J != nullptr)
+        fwrite(model.J, sizeof(ffm_int), model.n, f);
+
+    if(model.mask != nullptr)
+        fwrite(model.mask, 1, (ffm_long)model.m*model.m, f);
+
+    bool failed = ferror(f) != 0;
+    if(fclose(f) != 0 || failed)
+        return false;
+
+    return true;
+}
+
+// Write the weights of a model in training layout to path as a binary model.
+// The file is written next to path and renamed, so that a reader of path
+// always sees a complete model.
+bool save_snapshot(ffm_model const &model, ffm_int k, string const &path)
+{
+    string tmp_path = path + ".tmp";
+    return save_bin_model(model, k, (ffm_long)model.k*2, tmp_path.c_str()) && 
+           rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+// Train on the lines of in as they arrive, with nr_threads threads doing
+// Hogwild updates, and save a snapshot of the model to model_path every
+// interval seconds and at the end of the stream. Features j >= n and fields
+// f >= m are ignored.
+bool train_stream(
+    istream &in, 
+    string const &model_path, 
+    ffm_int n, 
+    ffm_int m, 
+    ffm_int interval, 
+    ffm_parameter param)
+{
+    shared_ptr<ffm_model> model = 
+        shared_ptr<ffm_model>(init_model(n, m, param),
+            [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+
+    LineRing ring;
+
+    auto consume = [&] ()
+    {
+        vector<string> batch;
+        vector<ffm_node> X;
+        vector<ffm_pair> pairs;
+        ffm_long batch_instances = 0;
+        ffm_double batch_loss = 0;
+
+        while(ring.pop(batch, batch_instances, batch_loss))
+        {
+            batch_instances = 0;
+            batch_loss = 0;
+            for(string const &line : batch)
+            {
+                char const *begin = line.data();
+                char const *end = begin+line.size();
+                if(count_tokens(begin, end) == 0)
+                    continue;
+
+                X.clear();
+                ffm_float scale = 0;
+                ffm_float y = scan_line(begin, end, [&] (ffm_int f, ffm_int j, ffm_float v)
+                {
+                    ffm_node N;
+                    N.f = f;
+                    N.j = j;
+                    N.v = v;
+                    X.push_back(N);
+                    scale += v*v;
+                });
+
+                ffm_float r = param.normalization? 1/scale : 1;
+
+                get_pairs(X.data(), X.data()+X.size(), *model, pairs);
+
+                ffm_float t = wTx(pairs, r, *model, 0, 0, 0, false, 0);
+
+                ffm_float expnyt = exp(-y*t);
+
+                batch_loss += log(1+expnyt);
+                batch_instances++;
+
+                ffm_float kappa = -y*expnyt/(1+expnyt);
+
+                wTx(pairs, r, *model, kappa, param.eta, param.lambda, true, 0);
+            }
+        }
+    };
+
+    mutex snapshot_mtx;
+    condition_variable snapshot_cv;
+    bool done = false;
+    bool ok = true;
+
+    auto snapshot = [&] ()
+    {
+        ffm_long nr_instances;
+        ffm_double loss;
+        ring.get_progress(nr_instances, loss);
+
+        if(!save_snapshot(*model, param.k, model_path))
+        {
+            cerr << "cannot write " << model_path << endl;
+            ok = false;
+        }
+        else if(!param.quiet)
+        {
+            cout << "snapshot: " << nr_instances << " instances, progressive logloss = " 
+                 << fixed << setprecision(5) << (nr_instances > 0? loss/nr_instances : 0) << endl;
+        }
+    };
+
+    thread snapshot_thread([&] ()
+    {
+        unique_lock<mutex> lock(snapshot_mtx);
+        while(!snapshot_cv.wait_for(lock, chrono::seconds(interval), [&] { return done; }))
+            snapshot();
+    });
+
+    vector<thread> threads;
+    for(ffm_int t = 0; t < param.nr_threads; t++)
+        threads.push_back(thread(consume));
+
+    string line;
+    while(getline(in, line))
+        ring.push(line);
+    ring.close();
+
+    for(thread &t : threads)
+        t.join();
+
+    {
+        lock_guard<mutex> lock(snapshot_mtx);
+        done = true;
+    }
+    snapshot_cv.notify_one();
+    snapshot_thread.join();
+
+    snapshot();
+
+    return ok;
+}
+
+} // unnamed namespace
+
+// Nodes beyond max_nodes are counted but not stored.
+ffm_int ffm_parse_line(char const *begin, char const *end, ffm_float *y, ffm_node *X, ffm_int max_nodes)
+{
+    ffm_int nr_nodes = 0;
+    *y = scan_line(begin, end, [&] (ffm_int f, ffm_int j, ffm_float v)
+    {
+        if(nr_nodes < max_nodes)
+        {
+            X[nr_nodes].f = f;
+            X[nr_nodes].j = j;
+            X[nr_nodes].v = v;
+        }
+        nr_nodes++;
+    });
+    return nr_nodes;
+}
+
+// The file is mapped and split into one piece per thread at line boundaries.
+// A first pass counts the instances and nodes of each piece, so that after a
+// prefix sum every piece is parsed directly into its place in X, P and Y.
+ffm_problem* ffm_read_problem(char const *path)
+{
+    if(strlen(path) == 0)
+        return nullptr;
+
+    TextFile txt(path);
+    if(!txt.ok())
+        return nullptr;
+
+    ffm_problem *prob = new ffm_problem;
+    prob->l = 0;
+    prob->n = 0;
+    prob->m = 0;
+    prob->X = nullptr;
+    prob->P = nullptr;
+    prob->Y = nullptr;
+    prob->J = nullptr;
+    prob->F = nullptr;
+    prob->I = nullptr;
+    prob->V = nullptr;
+
+    ffm_int nr_parts = get_max_threads();
+    vector<char const*> bounds = split_lines(txt.begin(), txt.end(), nr_parts);
+
+    vector<ffm_long> part_l(nr_parts+1, 0), part_nnz(nr_parts+1, 0);
+#if defined USEOMP
+#pragma omp parallel for num_threads(nr_parts) schedule(static)
+#endif
+    for(ffm_int t = 0; t < nr_parts; t++)
+    {
+        for_each_line(bounds[t], bounds[t+1], 
+            [&] (char const *, char const *, ffm_long nr_tokens)
+        {
+            part_l[t+1]++;
+            part_nnz[t+1] += nr_tokens-1;
+        });
+    }
+    partial_sum(part_l.begin(), part_l.end(), part_l.begin());
+    partial_sum(part_nnz.begin(), part_nnz.end(), part_nnz.begin());
+
+    prob->l = (ffm_int)part_l[nr_parts];
+    ffm_long nnz = part_nnz[nr_parts];
+
+    try
+    {
+        prob->X = (ffm_node*)malloc_huge(nnz*sizeof(ffm_node), "X");
+        prob->P = (ffm_long*)malloc_huge((prob->l+1)*sizeof(ffm_long), "P");
+        prob->Y = (ffm_float*)malloc_huge(prob->l*sizeof(ffm_float), "Y");
+    }
+    catch(bad_alloc const &e)
+    {
+        ffm_destroy_problem(&prob);
+        return nullptr;
+    }
+
+    vector<ffm_int> part_m(nr_parts, 0), part_n(nr_parts, 0);
+    prob->P[0] = 0;
+#if defined USEOMP
+#pragma omp parallel for num_threads(nr_parts) schedule(static)
+#endif
+    for(ffm_int t = 0; t < nr_parts; t++)
+    {
+        ffm_long i = part_l[t];
+        ffm_long p = part_nnz[t];
+        ffm_int m = 0, n = 0;
+        for_each_line(bounds[t], bounds[t+1], 
+            [&] (char const *line, char const *line_end, ffm_long)
+        {
+            prob->Y[i] = scan_line(line, line_end, [&] (ffm_int f, ffm_int j, ffm_float v)
+            {
+                m = max(m, f+1);
+                n = max(n, j+1);
+
+                prob->X[p].f = f;
+                prob->X[p].j = j;
+                prob->X[p].v = v;
+                p++;
+            });
+            prob->P[i+1] = p;
+            i++;
+        });
+        part_m[t] = m;
+        part_n[t] = n;
+    }
+
+    prob->m = *max_element(part_m.begin(), part_m.end());
+    prob->n = *max_element(part_n.begin(), part_n.end());
+
+    return prob;
+}
+
+// The file is mapped and parsed window by window; each window is split into
+// one piece per thread, and the parsed pieces are appended to the chunks in
+// order.
+int ffm_read_problem_to_disk(char const *txt_path, char const *bin_path)
+{
+    TextFile txt(txt_path);
+    if(!txt.ok())
+        return 1;
+
+    BinHeader header;
+    if(!get_source_info(txt_path, header))
+        return 1;
+
+    FILE *f_bin = fopen(bin_path, "wb");
+    if(f_bin == nullptr)
+        return 1;
+
+    ffm_int m = 0;
+    ffm_int n = 0;
+    ffm_int max_l = 0;
+    ffm_long max_nnz = 0;
+    ffm_long p = 0;
+
+    vector<ffm_float> Y;
+    vector<ffm_float> R;
+    vector<ffm_long> P(1, 0);
+    vector<ffm_int> F;
+    vector<ffm_uint> I;
+    vector<ffm_float> V;
+    ffm_int chunk_m = 0;
+    bool binary = true;
+
+    auto write_chunk = [&] ()
+    {
+        ffm_int l = Y.size();
+        ffm_long nnz = P[l];
+
+        max_l = max(max_l, l);
+        max_nnz = max(max_nnz, nnz);
+
+        ffm_int flags = 0;
+        if(binary)
+            flags |= kCHUNK_BINARY;
+        if(chunk_m > 256)
+            flags |= kCHUNK_WIDE_FIELDS;
+
+        fwrite(&l, sizeof(ffm_int), 1, f_bin);
+        if(l != 0)
+        {
+            fwrite(&flags, sizeof(ffm_int), 1, f_bin);
+            fwrite(Y.data(), sizeof(ffm_float), l, f_bin);
+            fwrite(R.data(), sizeof(ffm_float), l, f_bin);
+            fwrite(P.data(), sizeof(ffm_long), l+1, f_bin);
+            if(flags & kCHUNK_WIDE_FIELDS)
+            {
+                fwrite(F.data(), sizeof(ffm_int), nnz, f_bin);
+            }
+            else
+            {
+                vector<unsigned char> F_narrow(F.begin(), F.end());
+                fwrite(F_narrow.data(), sizeof(unsigned char), nnz, f_bin);
+            }
+            fwrite(I.data(), sizeof(ffm_uint), nnz, f_bin);
+            if(!binary)
+                fwrite(V.data(), sizeof(ffm_float), nnz, f_bin);
+        }
+
+        Y.clear();
+        R.clear();
+        P.assign(1, 0);
+        F.clear();
+        I.clear();
+        V.clear();
+        chunk_m = 0;
+        binary = true;
+        p = 0;
+    };
+
+    header.m = m;
+    header.n = n;
+    header.max_l = max_l;
+    header.max_nnz = max_nnz;
+    write_bin_header(f_bin, header);
+
+    ffm_int nr_parts = get_max_threads();
+    vector<TextPart> parts(nr_parts);
+
+    char const *window = txt.begin();
+    while(window != txt.end())
+    {
+        char const *window_end = window + min((size_t)(txt.end()-window), kTEXT_WINDOW_SIZE*nr_parts);
+        if(window_end != txt.end())
+        {
+            char const *nl = (char const*)memchr(window_end, '\n', txt.end()-window_end);
+            window_end = nl != nullptr? nl+1 : txt.end();
+        }
+
+        vector<char const*> bounds = split_lines(window, window_end, nr_parts);
+#if defined USEOMP
+#pragma omp parallel for num_threads(nr_parts) schedule(static)
+#endif
+        for(ffm_int t = 0; t < nr_parts; t++)
+            parts[t].parse(bounds[t], bounds[t+1]);
+
+        for(TextPart const &part : parts)
+        {
+            m = max(m, part.m);
+            n = max(n, part.n);
+
+            for(size_t i = 0; i < part.Y.size(); i++)
+            {
+                ffm_long begin = part.P[i], end = part.P[i+1];
+                for(ffm_long q = begin; q < end; q++)
+                {
+                    chunk_m = max(chunk_m, part.F[q]+1);
+                    binary = binary && part.V[q] == 1;
+                }
+                F.insert(F.end(), part.F.begin()+begin, part.F.begin()+end);
+                I.insert(I.end(), part.I.begin()+begin, part.I.begin()+end);
+                V.insert(V.end(), part.V.begin()+begin, part.V.begin()+end);
+                p += end-begin;
+
+                Y.push_back(part.Y[i]);
+                R.push_back(part.R[i]);
+                P.push_back(p);
+
+                if(I.size() > (size_t)kCHUNK_SIZE)
+                    write_chunk(); 
+            }
+        }
+
+        window = window_end;
+    }
+    write_chunk(); 
+    write_chunk(); 
+
+    header.m = m;
+    header.n = n;
+    header.max_l = max_l;
+    header.max_nnz = max_nnz;
+    rewind(f_bin);
+    write_bin_header(f_bin, header);
+
+    fclose(f_bin);
+
+    return 0;
+}
+
+bool ffm_is_bin_problem(char const *path)
+{
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return false;
+
+    BinHeader header;
+    bool ok = read_bin_header(f, header);
+    fclose(f);
+
+    return ok;
+}
+
+bool ffm_bin_problem_up_to_date(char const *txt_path, char const *bin_path)
+{
+    FILE *f = fopen(bin_path, "rb");
+    if(f == nullptr)
+        return false;
+
+    BinHeader header;
+    bool ok = read_bin_header(f, header);
+    fclose(f);
+    if(!ok)
+        return false;
+
+    BinHeader source;
+    if(!get_source_info(txt_path, source))
+        return false;
+
+    return header.src_path == source.src_path &&
+           header.src_size == source.src_size &&
+           header.src_mtime == source.src_mtime &&
+           header.src_fingerprint == source.src_fingerprint;
+}
+
+void ffm_destroy_problem(ffm_problem **prob)
+{
+    if(prob == nullptr || *prob == nullptr)
+        return;
+    free_aligned((*prob)->X);
+    free_aligned((*prob)->P);
+    free_aligned((*prob)->Y);
+    free_aligned((*prob)->F);
+    free_aligned((*prob)->I);
+    free_aligned((*prob)->V);
+    delete[] (*prob)->J;
+    delete *prob;
+    *prob = nullptr;
+}
+
+// Replace the nodes of prob by one byte per field, a 32-bit feature index,
+// and the values only if some of them are not 1. This cuts the 12 bytes per
+// node to 5 on binary data.
+ffm_int ffm_compact_problem(ffm_problem *prob)
+{
+    if(prob->X == nullptr)
+        return 0;
+    if(prob->m > 256)
+        return 1;
+
+    ffm_long nnz = prob->P[prob->l];
+
+    bool binary = true;
+    for(ffm_long p = 0; p < nnz && binary; p++)
+        binary = prob->X[p].v == 1;
+
+    unsigned char *F = nullptr;
+    ffm_uint *I = nullptr;
+    ffm_float *V = nullptr;
+    try
+    {
+        F = (unsigned char*)malloc_huge(nnz*sizeof(unsigned char), "F");
+        I = (ffm_uint*)malloc_huge(nnz*sizeof(ffm_uint), "I");
+        if(!binary)
+            V = (ffm_float*)malloc_huge(nnz*sizeof(ffm_float), "V");
+    }
+    catch(bad_alloc const &e)
+    {
+        free_aligned(F);
+        free_aligned(I);
+        return 1;
+    }
+
+    for(ffm_long p = 0; p < nnz; p++)
+    {
+        F[p] = (unsigned char)prob->X[p].f;
+        I[p] = (ffm_uint)prob->X[p].j;
+        if(!binary)
+            V[p] = prob->X[p].v;
+    }
+
+    free_aligned(prob->X);
+    prob->X = nullptr;
+    prob->F = F;
+    prob->I = I;
+    prob->V = V;
+
+    return 0;
+}
+
+// Renumber the features by descending frequency, so that the rows of the
+// most common features are adjacent in W and tend to stay in cache.
+void ffm_remap_problem(ffm_problem *prob)
+{
+    if(prob->J != nullptr)
+        return;
+
+    vector<ffm_long> freq(prob->n, 0);
+    ffm_long nnz = prob->P[prob->l];
+    for(ffm_long p = 0; p < nnz; p++)
+        freq[prob->X != nullptr? prob->X[p].j : prob->I[p]]++;
+
+    vector<ffm_int> ids(prob->n);
+    iota(ids.begin(), ids.end(), 0);
+    stable_sort(ids.begin(), ids.end(),
+        [&](ffm_int a, ffm_int b) { return freq[a] > freq[b]; });
+
+    prob->J = new ffm_int[prob->n];
+    for(ffm_int i = 0; i < prob->n; i++)
+        prob->J[ids[i]] = i;
+
+    for(ffm_long p = 0; p < nnz; p++)
+    {
+        if(prob->X != nullptr)
+            prob->X[p].j = prob->J[prob->X[p].j];
+        else
+            prob->I[p] = prob->J[prob->I[p]];
+    }
+}
+
+// Apply the remapping of ref to prob. Features that ref has not seen are not
+// in the model and are left as they are.
+void ffm_apply_remap(ffm_problem *prob, ffm_problem const *ref)
+{
+    if(ref->J == nullptr || prob->J != nullptr)
+        return;
+
+    ffm_long nnz = prob->P[prob->l];
+    for(ffm_long p = 0; p < nnz; p++)
+    {
+        ffm_int j = prob->X != nullptr? prob->X[p].j : (ffm_int)prob->I[p];
+        if(j >= ref->n)
+            continue;
+        if(prob->X != nullptr)
+            prob->X[p].j = ref->J[j];
+        else
+            prob->I[p] = ref->J[j];
+    }
+
+    // Record the mapping that was applied; unseen ids map to themselves.
+    prob->J = new ffm_int[prob->n];
+    for(ffm_int j = 0; j < prob->n; j++)
+        prob->J[j] = j < ref->n? ref->J[j] : j;
+}
+
+ffm_int ffm_save_model(ffm_model *model, char const *path)
+{
+    return save_bin_model(*model, model->k, model->k, path)? 0 : 1;
+}
+
+ffm_int ffm_save_txt_model(ffm_model *model, char const *path)
+{
+    // The text format has no pair mask.
+    if(model->mask != nullptr)
+        return 1;
+
+    ofstream f_out(path);
+    if(!f_out.is_open())
+        return 1;
+
+    f_out << "n " << model->n << "\n";
+    f_out << "m " << model->m << "\n";
+    f_out << "k " << model->k << "\n";
+    f_out << "normalization " << model->normalization << "\n";
+
+    // The text format has no feature remapping, so rows are written in the
+    // original feature order.
+    for(ffm_int j = 0; j < model->n; j++)
+    {
+        ffm_int row = model->J != nullptr? model->J[j] : j;
+        ffm_float *ptr = model->W + (ffm_long)row*model->m*model->k;
+        for(ffm_int f = 0; f < model->m; f++)
+        {
+            f_out << "w" << j << "," << f << " ";
+            for(ffm_int d = 0; d < model->k; d++, ptr++)
+                f_out << *ptr << " ";
+            f_out << "\n";
+        }
+    }
+
+    return 0;
+}
+
+namespace {
+
+ffm_model* load_txt_model(char const *path)
+{
+    ifstream f_in(path);
+    if(!f_in.is_open())
+        return nullptr;
+
+    string dummy;
+
+    ffm_model *model = new ffm_model;
+    model->W = nullptr;
+    model->J = nullptr;
+    model->mask = nullptr;
+
+    f_in >> dummy >> model->n >> dummy >> model->m >> dummy >> model->k 
+         >> dummy >> model->normalization;
+
+    try
+    {
+        model->W = malloc_aligned_float((ffm_long)model->m*model->n*model->k);
+    }
+    catch(bad_alloc const &e)
+    {
+        ffm_destroy_model(&model);
+        return nullptr;
+    }
+
+    ffm_float *ptr = model->W;
+    for(ffm_int j = 0; j < model->n; j++)
+    {
+        for(ffm_int f = 0; f < model->m; f++)
+        {
+            f_in >> dummy;
+            for(ffm_int d = 0; d < model->k; d++, ptr++)
+                f_in >> *ptr;
+        }
+    }
+
+    return model;
+}
+
+// Map the payload of a binary model read-only. The mapping is shared, so
+// several predictor processes loading the same file share one copy of W in
+// the page cache. Where mmap is not available, W is read into memory.
+ffm_float* map_model_payload(char const *path, ffm_long offset, ffm_long size)
+{
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+        return nullptr;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < offset+size)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, offset+size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+        return nullptr;
+
+    ffm_float *W = (ffm_float*)((char*)base+offset);
+    register_mapping(W, base, offset+size);
+
+    return W;
+#else
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return nullptr;
+
+    ffm_float *W = nullptr;
+    try
+    {
+        W = (ffm_float*)malloc_aligned(size);
+    }
+    catch(bad_alloc const &e)
+    {
+        fclose(f);
+        return nullptr;
+    }
+
+    if(fseek(f, offset, SEEK_SET) != 0 || fread(W, 1, size, f) != (size_t)size)
+    {
+        free_aligned(W);
+        W = nullptr;
+    }
+    fclose(f);
+
+    return W;
+#endif
+}
+
+ffm_model* load_bin_model(char const *path)
+{
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return nullptr;
+
+    char magic[sizeof(kMODEL_MAGIC)];
+    ffm_int version = 0, normalization = 0;
+    ffm_long offset = 0, remap_offset = 0, mask_offset = 0;
+
+    ffm_model *model = new ffm_model;
+    model->W = nullptr;
+    model->J = nullptr;
+    model->mask = nullptr;
+
+    bool ok = 
+        fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+        fread(&version, sizeof(ffm_int), 1, f) == 1 &&
+        version >= 1 && version <= kMODEL_VERSION &&
+        fread(&model->n, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&model->m, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&model->k, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&normalization, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&offset, sizeof(ffm_long), 1, f) == 1 &&
+        (version < 2 || fread(&remap_offset, sizeof(ffm_long), 1, f) == 1) &&
+        (version < 3 || fread(&mask_offset, sizeof(ffm_long), 1, f) == 1);
+
+    if(ok && remap_offset != 0)
+    {
+        model->J = new ffm_int[model->n];
+        ok = fseek(f, remap_offset, SEEK_SET) == 0 &&
+             fread(model->J, sizeof(ffm_int), model->n, f) == (size_t)model->n;
+    }
+
+    if(ok && mask_offset != 0)
+    {
+        ffm_long mask_size = (ffm_long)model->m*model->m;
+        model->mask = new unsigned char[mask_size];
+        ok = fseek(f, mask_offset, SEEK_SET) == 0 &&
+             fread(model->mask, 1, mask_size, f) == (size_t)mask_size;
+    }
+    fclose(f);
+
+    if(ok)
+    {
+        model->normalization = normalization != 0;
+        model->W = map_model_payload(path, offset, 
+            (ffm_long)model->n*model->m*model->k*sizeof(ffm_float));
+    }
+
+    if(model->W == nullptr)
+    {
+        ffm_destroy_model(&model);
+        return nullptr;
+    }
+
+    return model;
+}
 
 } // unnamed namespace
 
-ffm_problem* ffm_read_problem(char const *path)
+ffm_model* ffm_load_model(char const *path)
 {
-    if(strlen(path) == 0)
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
         return nullptr;
 
-    FILE *f = fopen(path, "r");
+    char magic[sizeof(kMODEL_MAGIC)];
+    bool is_bin = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                  memcmp(magic, kMODEL_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+
+    if(is_bin)
+        return load_bin_model(path);
+    else
+        return load_txt_model(path);
+}
+
+// The file is written in place, so processes that have it mapped (see
+// ffm_load_model) see the new rows without reloading it. Consecutive rows are
+// written together.
+ffm_int ffm_apply_delta(char const *model_path, char const *delta_path)
+{
+    FILE *f_delta = fopen(delta_path, "rb");
+    if(f_delta == nullptr)
+        return 1;
+
+    char magic[sizeof(kDELTA_MAGIC)];
+    ffm_int version = 0, n = 0, m = 0, k = 0, normalization = 0;
+    ffm_long nr_rows = 0;
+
+    bool ok = 
+        fread(magic, 1, sizeof(magic), f_delta) == sizeof(magic) &&
+        memcmp(magic, kDELTA_MAGIC, sizeof(magic)) == 0 &&
+        fread(&version, sizeof(ffm_int), 1, f_delta) == 1 &&
+        version == kDELTA_VERSION &&
+        fread(&n, sizeof(ffm_int), 1, f_delta) == 1 &&
+        fread(&m, sizeof(ffm_int), 1, f_delta) == 1 &&
+        fread(&k, sizeof(ffm_int), 1, f_delta) == 1 &&
+        fread(&normalization, sizeof(ffm_int), 1, f_delta) == 1 &&
+        fread(&nr_rows, sizeof(ffm_long), 1, f_delta) == 1 &&
+        nr_rows >= 0 && nr_rows <= (ffm_long)n*m;
+
+    vector<ffm_long> rows;
+    vector<ffm_float> values;
+    if(ok)
+    {
+        rows.resize(nr_rows);
+        values.resize(nr_rows*k);
+        ok = fread(rows.data(), sizeof(ffm_long), nr_rows, f_delta) == (size_t)nr_rows &&
+             fread(values.data(), sizeof(ffm_float), values.size(), f_delta) == values.size();
+    }
+    fclose(f_delta);
+
+    for(ffm_long r = 0; ok && r < nr_rows; r++)
+        ok = rows[r] >= 0 && rows[r] < (ffm_long)n*m && (r == 0 || rows[r] > rows[r-1]);
+    if(!ok)
+        return 1;
+
+    FILE *f = fopen(model_path, "r+b");
     if(f == nullptr)
+        return 1;
+
+    ffm_int model_version = 0, model_n = 0, model_m = 0, model_k = 0, model_normalization = 0;
+    ffm_long offset = 0;
+
+    ok = 
+        fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+        memcmp(magic, kMODEL_MAGIC, sizeof(magic)) == 0 &&
+        fread(&model_version, sizeof(ffm_int), 1, f) == 1 &&
+        model_version >= 1 && model_version <= kMODEL_VERSION &&
+        fread(&model_n, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&model_m, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&model_k, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&model_normalization, sizeof(ffm_int), 1, f) == 1 &&
+        fread(&offset, sizeof(ffm_long), 1, f) == 1 &&
+        model_n == n && model_m == m && model_k == k && 
+        (model_normalization != 0) == (normalization != 0);
+
+    for(ffm_long r = 0; ok && r < nr_rows; )
+    {
+        ffm_long r_end = r+1;
+        while(r_end < nr_rows && rows[r_end] == rows[r_end-1]+1)
+            r_end++;
+
+        ok = fseek(f, offset + rows[r]*k*(ffm_long)sizeof(ffm_float), SEEK_SET) == 0 &&
+             fwrite(values.data()+r*k, sizeof(ffm_float), (r_end-r)*k, f) == (size_t)((r_end-r)*k);
+        r = r_end;
+    }
+
+    bool failed = ferror(f) != 0;
+    if(fclose(f) != 0 || failed || !ok)
+        return 1;
+
+    return 0;
+}
+
+// A text file with one pair of fields "f1 f2" to leave out per line; the
+// order of f1 and f2 does not matter. Lines starting with # are comments.
+ffm_pair_mask* ffm_read_pair_mask(char const *path)
+{
+    ifstream f_in(path);
+    if(!f_in.is_open())
         return nullptr;
 
-    ffm_problem *prob = new ffm_problem;
-    prob->l = 0;
-    prob->n = 0;
-    prob->m = 0;
-    prob->X = nullptr;
-    prob->P = nullptr;
-    prob->Y = nullptr;
+    vector<pair<ffm_int, ffm_int>> pruned;
+    ffm_int m = 0;
+    string line;
+    while(getline(f_in, line))
+    {
+        if(line.empty() || line[0] == '#')
+            continue;
+
+        ffm_int f1, f2;
+        if(sscanf(line.c_str(), "%d %d", &f1, &f2) != 2 || f1 < 0 || f2 < 0)
+            return nullptr;
+
+        pruned.push_back(make_pair(f1, f2));
+        m = max(m, max(f1, f2)+1);
+    }
+
+    ffm_pair_mask *mask = new ffm_pair_mask;
+    mask->m = m;
+    mask->allowed = new unsigned char[(ffm_long)m*m];
+    fill(mask->allowed, mask->allowed+(ffm_long)m*m, 1);
+    for(pair<ffm_int, ffm_int> const &p : pruned)
+    {
+        mask->allowed[(ffm_long)p.first*m+p.second] = 0;
+        mask->allowed[(ffm_long)p.second*m+p.first] = 0;
+    }
+
+    return mask;
+}
+
+ffm_int ffm_save_pair_mask(ffm_pair_mask const *mask, char const *path)
+{
+    ofstream f_out(path);
+    if(!f_out.is_open())
+        return 1;
+
+    for(ffm_int f1 = 0; f1 < mask->m; f1++)
+        for(ffm_int f2 = f1; f2 < mask->m; f2++)
+            if(!mask->allowed[(ffm_long)f1*mask->m+f2])
+                f_out << f1 << " " << f2 << "\n";
+
+    return f_out.good()? 0 : 1;
+}
+
+void ffm_destroy_pair_mask(ffm_pair_mask **mask)
+{
+    if(mask == nullptr || *mask == nullptr)
+        return;
+    delete[] (*mask)->allowed;
+    delete *mask;
+    *mask = nullptr;
+}
+
+void ffm_set_pair_mask(ffm_model *model, ffm_pair_mask const *mask)
+{
+    delete[] model->mask;
+    model->mask = make_mask(model->m, mask);
+}
+
+void ffm_destroy_model(ffm_model **model)
+{
+    if(model == nullptr || *model == nullptr)
+        return;
+    free_aligned((*model)->W);
+    delete[] (*model)->J;
+    delete[] (*model)->mask;
+    delete *model;
+    *model = nullptr;
+}
+
+void ffm_set_huge_pages(bool enable)
+{
+    use_huge_pages = enable;
+}
+
+void ffm_report_huge_pages()
+{
+#if defined __linux__
+    lock_guard<mutex> lock(mappings_mtx);
+
+    bool found = false;
+    for(auto const &it : mappings)
+    {
+        Mapping const &mapping = it.second;
+        if(mapping.kind == kFILE)
+            continue;
+        found = true;
+
+        size_t nr_pages = mapping.size/mapping.page_size;
+        size_t nr_huge = mapping.kind == kHUGETLB? 
+            nr_pages : get_thp_size(mapping.base, mapping.size)/mapping.page_size;
+
+        cout << "huge pages: " << mapping.name << ": " << fixed << setprecision(1) 
+             << mapping.size/1048576.0 << " MB, " << nr_huge << " of " << nr_pages << " " 
+             << (mapping.page_size>>20) << "MB pages" 
+             << (mapping.kind == kHUGETLB? " (hugetlb)" : " (transparent)") << endl;
+    }
+
+    if(!found)
+        cout << "huge pages: none" << endl;
+#else
+    cout << "huge pages: not supported on this platform" << endl;
+#endif
+}
+
+ffm_parameter ffm_get_default_param()
+{
+    ffm_parameter param;
+
+    param.eta = 0.2;
+    param.lambda = 0.00002;
+    param.nr_iters = 15;
+    param.k = 4;
+    param.nr_threads = 1;
+    param.quiet = false;
+    param.normalization = true;
+    param.random = true;
+    param.auto_stop = false;
+    param.numa = false;
+    param.prefetch_distance = 8;
+    param.block_size = 0;
+    param.relayout = false;
+    param.deterministic = false;
+    param.pair_mask = nullptr;
+    param.neg_sample_rate = 1;
+
+    return param;
+}
+
+ffm_model* ffm_train_with_validation(ffm_problem *tr, ffm_problem *va, ffm_parameter param)
+{
+    vector<ffm_int> order(tr->l);
+    for(ffm_int i = 0; i < tr->l; i++)
+        order[i] = i;
+
+    shared_ptr<ffm_model> model = train(tr, order, param, va);
+
+    return release_model(model, tr);
+}
+
+ffm_int ffm_train_sweep(
+    ffm_problem *tr, 
+    ffm_problem *va, 
+    ffm_parameter const *params, 
+    ffm_int nr_models, 
+    ffm_sweep_result *results)
+{
+    vector<shared_ptr<ffm_model>> models = train_sweep(tr, va, params, nr_models, results);
+
+    for(ffm_int i = 0; i < nr_models; i++)
+        results[i].model = release_model(models[i], tr);
+
+    return 0;
+}
+
+ffm_model* ffm_train(ffm_problem *prob, ffm_parameter param)
+{
+    return ffm_train_with_validation(prob, nullptr, param);
+}
+
+ffm_model* ffm_train_with_validation_on_disk(
+    char const *tr_path,
+    char const *va_path,
+    ffm_parameter param)
+{
+    shared_ptr<ffm_model> model = train_on_disk(tr_path, va_path, param);
+
+    return release_model(model, nullptr);
+}
+
+ffm_model* ffm_train_on_disk(char const *prob_path, ffm_parameter param)
+{
+    return ffm_train_with_validation_on_disk(prob_path, "", param);
+}
+
+ffm_model* ffm_train_with_checkpoint(
+    ffm_problem *tr, 
+    ffm_problem *va, 
+    char const *init_path, 
+    char const *checkpoint_path, 
+    char const *delta_path, 
+    ffm_parameter param)
+{
+    // A checkpoint has no feature remapping.
+    if(tr->J != nullptr)
+        return nullptr;
+
+    shared_ptr<ffm_model> init;
+    if(init_path != nullptr)
+    {
+        init = shared_ptr<ffm_model>(load_checkpoint(init_path, param.k),
+            [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+        if(init == nullptr)
+            return nullptr;
+        param.normalization = init->normalization;
+    }
+
+    vector<ffm_int> order(tr->l);
+    for(ffm_int i = 0; i < tr->l; i++)
+        order[i] = i;
+
+    unique_ptr<RowTracker> changed;
+    shared_ptr<ffm_model> model = 
+        train(tr, order, param, va, init.get(), false, delta_path != nullptr? &changed : nullptr);
+
+    return release_model(model, tr, param.k, init.get(), changed.get(), checkpoint_path, delta_path);
+}
+
+ffm_model* ffm_train_with_checkpoint_on_disk(
+    char const *tr_path,
+    char const *va_path,
+    char const *init_path, 
+    char const *checkpoint_path, 
+    char const *delta_path, 
+    ffm_parameter param)
+{
+    shared_ptr<ffm_model> init;
+    if(init_path != nullptr)
+    {
+        init = shared_ptr<ffm_model>(load_checkpoint(init_path, param.k),
+            [] (ffm_model *ptr) { ffm_destroy_model(&ptr); });
+        if(init == nullptr)
+            return nullptr;
+        param.normalization = init->normalization;
+    }
+
+    unique_ptr<RowTracker> changed;
+    shared_ptr<ffm_model> model = 
+        train_on_disk(tr_path, va_path != nullptr? va_path : "", param, nullptr, -1, 
+                      init.get(), false, delta_path != nullptr? &changed : nullptr);
+
+    return release_model(model, nullptr, param.k, init.get(), changed.get(), checkpoint_path, delta_path);
+}
+
+ffm_int ffm_train_stream(
+    char const *path,
+    char const *model_path,
+    ffm_int n,
+    ffm_int m,
+    ffm_int snapshot_interval,
+    ffm_parameter param)
+{
+    if(strcmp(path, "-") == 0)
+        return train_stream(cin, model_path, n, m, snapshot_interval, param)? 0 : 1;
+
+    ifstream f_in(path);
+    if(!f_in.is_open())
+        return 1;
+
+    return train_stream(f_in, model_path, n, m, snapshot_interval, param)? 0 : 1;
+}
+
+ffm_model* ffm_train_distributed(
+    char const *tr_path,
+    char const *va_path,
+    ffm_int nr_workers,
+    ffm_int nr_servers,
+    ffm_parameter param)
+{
+#if defined __linux__
+    shared_ptr<ffm_model> model = train_distributed(tr_path, va_path, nr_workers, nr_servers, param);
+    if(model == nullptr)
+        return nullptr;
+
+    return release_model(model, nullptr);
+#else
+    return nullptr;
+#endif
+}
+
+ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model)
+{
+    thread_local vector<ffm_node> buffer;
+    remap_nodes(begin, end, model->J, model->n, buffer);
+
+    ffm_float r = model->normalization? get_scale(begin, end) : 1;
+
+    ffm_float t = wTx_predict(begin, end, r, *model);
+
+    return 1/(1+exp(-t));
+}
+
+// The same sum as wTx_predict, one term at a time.
+ffm_float ffm_pair_contributions(ffm_node *begin, ffm_node *end, ffm_model *model, ffm_float *C)
+{
+    thread_local vector<ffm_node> buffer;
+    remap_nodes(begin, end, model->J, model->n, buffer);
 
-    char line[kMaxLineSize];
+    ffm_float r = model->normalization? get_scale(begin, end) : 1;
 
-    ffm_long nnz = 0;
-    for(; fgets(line, kMaxLineSize, f) != nullptr; prob->l++)
+    ffm_long align0 = (ffm_long)model->k;
+    ffm_long align1 = (ffm_long)model->m*align0;
+
+    ffm_float t = 0;
+    for(ffm_node *N1 = begin; N1 != end; N1++)
     {
-        strtok(line, " \t");
-        for(; ; nnz++)
+        ffm_int j1 = N1->j;
+        ffm_int f1 = N1->f;
+        if(j1 >= model->n || f1 >= model->m)
+            continue;
+
+        for(ffm_node *N2 = N1+1; N2 != end; N2++)
         {
-            char *ptr = strtok(nullptr," \t");
-            if(ptr == nullptr || *ptr == '\n')
-                break;
+            ffm_int j2 = N2->j;
+            ffm_int f2 = N2->f;
+            if(j2 >= model->n || f2 >= model->m || 
+               (model->mask != nullptr && !model->mask[(ffm_long)f1*model->m+f2]))
+                continue;
+
+            ffm_float const *w1 = model->W + j1*align1 + f2*align0;
+            ffm_float const *w2 = model->W + j2*align1 + f1*align0;
+
+            ffm_float c = 0;
+            for(ffm_int d = 0; d < model->k; d++)
+                c += w1[d]*w2[d];
+            c *= N1->v*N2->v*r;
+
+            C[(ffm_long)min(f1, f2)*model->m+max(f1, f2)] += c;
+            t += c;
         }
     }
-    rewind(f);
 
-    prob->X = new ffm_node[nnz];
-    prob->P = new ffm_long[prob->l+1];
-    prob->Y = new ffm_float[prob->l];
+    return t;
+}
+
+void ffm_predict_batch(
+    ffm_node *X, 
+    ffm_long *P, 
+    ffm_float *R, 
+    ffm_int l, 
+    ffm_model *model, 
+    ffm_float *out, 
+    ffm_int nr_threads)
+{
+    ffm_int const kBlockSize = 1024;
+    ffm_int nr_blocks = (l+kBlockSize-1)/kBlockSize;
 
-    ffm_long p = 0;
-    prob->P[0] = 0;
-    for(ffm_int i = 0; fgets(line, kMaxLineSize, f) != nullptr; i++)
+    // Each block is scored and passed through the vectorized sigmoid while
+    // its outputs are still in cache.
+#if defined USEOMP
+#pragma omp parallel for schedule(static) num_threads(max(nr_threads, 1)) if(nr_threads > 1)
+#endif
+    for(ffm_int b = 0; b < nr_blocks; b++)
     {
-        char *y_char = strtok(line, " \t");
-        ffm_float y = (atoi(y_char)>0)? 1.0f : -1.0f;
-        prob->Y[i] = y;
+        ffm_int begin = b*kBlockSize;
+        ffm_int end = min(begin+kBlockSize, l);
 
-        for(; ; p++)
+        vector<ffm_node> buffer;
+        for(ffm_int i = begin; i < end; i++)
         {
-            char *field_char = strtok(nullptr,":");
-            char *idx_char = strtok(nullptr,":");
-            char *value_char = strtok(nullptr," \t");
-            if(field_char == nullptr || *field_char == '\n')
-                break;
+            ffm_node *x_begin = X+P[i];
+            ffm_node *x_end = X+P[i+1];
+            remap_nodes(x_begin, x_end, model->J, model->n, buffer);
 
-            ffm_int field = atoi(field_char);
-            ffm_int idx = atoi(idx_char);
-            ffm_float value = atof(value_char);
+            ffm_float r = 1;
+            if(model->normalization)
+                r = R != nullptr? R[i] : get_scale(x_begin, x_end);
 
-            prob->m = max(prob->m, field+1);
-            prob->n = max(prob->n, idx+1);
-            
-            prob->X[p].f = field;
-            prob->X[p].j = idx;
-            prob->X[p].v = value;
+            out[i] = wTx_predict(x_begin, x_end, r, *model);
         }
-        prob->P[i+1] = p;
-    }
-
-    fclose(f);
 
-    return prob;
+        sigmoid(out+begin, end-begin);
+    }
 }
 
-int ffm_read_problem_to_disk(char const *txt_path, char const *bin_path)
+// Everything a candidate needs to know about the shared context features:
+// the context-only interaction sum, the squared norm of the context (for
+// normalization), and for each context field f1 and each field f2
+//
+//     C[f1][f2] = sum of v*w_{j,f2} over context nodes (j, f1, v),
+//
+// so that all candidate x context pairs of a candidate node (j2, f2, v2)
+// reduce to v2 * sum_f1 <w_{j2,f1}, C[f1][f2]>.
+struct ffm_context
 {
-    FILE *f_txt = fopen(txt_path, "r");
-    if(f_txt == nullptr)
-        return 1;
+    ffm_model *model;
+    ffm_float t;
+    ffm_float norm;
+    vector<ffm_int> fields;
+    vector<ffm_float> C;
+};
 
-    FILE *f_bin = fopen(bin_path, "wb");
-    if(f_bin == nullptr)
-        return 1;
+ffm_context* ffm_create_context(ffm_node *begin, ffm_node *end, ffm_model *model)
+{
+    vector<ffm_node> buffer;
+    remap_nodes(begin, end, model->J, model->n, buffer);
 
-    vector<char> line(kMaxLineSize);
+    ffm_context *ctx = new ffm_context;
+    ctx->model = model;
+    ctx->t = wTx_predict(begin, end, 1, *model);
+    ctx->norm = 0;
 
-    ffm_int m = 0;
-    ffm_int n = 0;
-    ffm_int max_l = 0;
-    ffm_long max_nnz = 0;
-    ffm_long p = 0;
+    vector<ffm_int> field_pos(model->m, -1);
+    for(ffm_node *N = begin; N != end; N++)
+    {
+        ctx->norm += N->v*N->v;
+        if(N->j >= model->n || N->f >= model->m || field_pos[N->f] != -1)
+            continue;
+        field_pos[N->f] = ctx->fields.size();
+        ctx->fields.push_back(N->f);
+    }
 
-    vector<ffm_float> Y;
-    vector<ffm_float> R;
-    vector<ffm_long> P(1, 0);
-    vector<ffm_node> X;
+    ffm_long align0 = (ffm_long)model->k;
+    ffm_long align1 = (ffm_long)model->m*align0;
 
-    auto write_chunk = [&] ()
+    ctx->C.assign(ctx->fields.size()*align1, 0);
+    for(ffm_node *N = begin; N != end; N++)
     {
-        ffm_int l = Y.size();
-        ffm_long nnz = P[l];
+        if(N->j >= model->n || N->f >= model->m)
+            continue;
 
-        max_l = max(max_l, l);
-        max_nnz = max(max_nnz, nnz);
+        ffm_float const *w = model->W + N->j*align1;
+        ffm_float *c = ctx->C.data() + field_pos[N->f]*align1;
+        for(ffm_long d = 0; d < align1; d++)
+            c[d] += N->v*w[d];
+    }
 
-        fwrite(&l, sizeof(ffm_int), 1, f_bin);
-        fwrite(Y.data(), sizeof(ffm_float), l, f_bin);
-        fwrite(R.data(), sizeof(ffm_float), l, f_bin);
-        fwrite(P.data(), sizeof(ffm_long), l+1, f_bin);
-        fwrite(X.data(), sizeof(ffm_node), nnz, f_bin);
+    return ctx;
+}
 
-        Y.clear();
-        R.clear();
-        P.assign(1, 0);
-        X.clear();
-        p = 0;
-    };
+ffm_float ffm_predict_with_context(ffm_context *ctx, ffm_node *begin, ffm_node *end)
+{
+    ffm_model &model = *ctx->model;
 
-    fwrite(&m, sizeof(ffm_int), 1, f_bin);
-    fwrite(&n, sizeof(ffm_int), 1, f_bin);
-    fwrite(&max_l, sizeof(ffm_int), 1, f_bin);
-    fwrite(&max_nnz, sizeof(ffm_long), 1, f_bin);
+    thread_local vector<ffm_node> buffer;
+    remap_nodes(begin, end, model.J, model.n, buffer);
 
-    while(fgets(line.data(), kMaxLineSize, f_txt))
-    {
-        char *y_char = strtok(line.data(), " \t");
+    ffm_long align0 = (ffm_long)model.k;
+    ffm_long align1 = (ffm_long)model.m*align0;
+    ffm_int nr_fields = ctx->fields.size();
+    ffm_int k4 = model.k/4*4;
 
-        ffm_float y = (atoi(y_char)>0)? 1.0f : -1.0f;
+    ffm_float t = ctx->t + wTx_predict(begin, end, 1, model);
+    ffm_float norm = ctx->norm;
 
-        ffm_float scale = 0;
-        for(; ; p++)
-        {
-            char *field_char = strtok(nullptr,":");
-            char *idx_char = strtok(nullptr,":");
-            char *value_char = strtok(nullptr," \t");
-            if(field_char == nullptr || *field_char == '\n')
-                break;
+    for(ffm_node *N2 = begin; N2 != end; N2++)
+    {
+        norm += N2->v*N2->v;
 
-            ffm_node N;
-            N.f = atoi(field_char);
-            N.j = atoi(idx_char);
-            N.v = atof(value_char);
+        ffm_int j2 = N2->j;
+        ffm_int f2 = N2->f;
+        if(j2 >= model.n || f2 >= model.m)
+            continue;
 
-            X.push_back(N);
+        __m128 XMMt = _mm_setzero_ps();
+        ffm_float t2 = 0;
+        for(ffm_int i = 0; i < nr_fields; i++)
+        {
+            if(model.mask != nullptr && !model.mask[(ffm_long)ctx->fields[i]*model.m+f2])
+                continue;
 
-            m = max(m, N.f+1);
-            n = max(n, N.j+1);
+            ffm_float const *w = model.W + j2*align1 + ctx->fields[i]*align0;
+            ffm_float const *c = ctx->C.data() + i*align1 + f2*align0;
 
-            scale += N.v*N.v;
+            ffm_int d = 0;
+            for(; d < k4; d += 4)
+                XMMt = _mm_add_ps(XMMt, _mm_mul_ps(_mm_loadu_ps(w+d), _mm_loadu_ps(c+d)));
+            for(; d < model.k; d++)
+                t2 += w[d]*c[d];
         }
-        scale = 1/scale;
-
-        Y.push_back(y);
-        R.push_back(scale);
-        P.push_back(p);
+        XMMt = _mm_hadd_ps(XMMt, XMMt);
+        XMMt = _mm_hadd_ps(XMMt, XMMt);
+        ffm_float t2_simd;
+        _mm_store_ss(&t2_simd, XMMt);
 
-        if(X.size() > (size_t)kCHUNK_SIZE)
-            write_chunk(); 
+        t += N2->v*(t2+t2_simd);
     }
-    write_chunk(); 
-    write_chunk(); 
-
-    rewind(f_bin);
-    fwrite(&m, sizeof(ffm_int), 1, f_bin);
-    fwrite(&n, sizeof(ffm_int), 1, f_bin);
-    fwrite(&max_l, sizeof(ffm_int), 1, f_bin);
-    fwrite(&max_nnz, sizeof(ffm_long), 1, f_bin);
 
-    fclose(f_bin);
-    fclose(f_txt);
+    if(model.normalization)
+        t /= norm;
 
-    return 0;
+    return 1/(1+exp(-t));
 }
 
-void ffm_destroy_problem(ffm_problem **prob)
+void ffm_destroy_context(ffm_context **ctx)
 {
-    if(prob == nullptr || *prob == nullptr)
+    if(ctx == nullptr || *ctx == nullptr)
         return;
-    delete[] (*prob)->X;
-    delete[] (*prob)->P;
-    delete[] (*prob)->Y;
-    delete *prob;
-    *prob = nullptr;
+    delete *ctx;
+    *ctx = nullptr;
 }
 
-ffm_int ffm_save_model(ffm_model *model, char const *path)
+ffm_qmodel* ffm_quantize_model(ffm_model *model)
 {
-    ofstream f_out(path);
-    if(!f_out.is_open())
-        return 1;
-
-    f_out << "n " << model->n << "\n";
-    f_out << "m " << model->m << "\n";
-    f_out << "k " << model->k << "\n";
-    f_out << "normalization " << model->normalization << "\n";
+    // Quantized models have no pair mask.
+    if(model->mask != nullptr)
+        return nullptr;
 
-    ffm_float *ptr = model->W;
-    for(ffm_int j = 0; j < model->n; j++)
+    ffm_int qk = get_qk(model->k);
+    ffm_long nr_rows = (ffm_long)model->n*model->m;
+
+    ffm_qmodel *qmodel = new ffm_qmodel;
+    qmodel->n = model->n;
+    qmodel->m = model->m;
+    qmodel->k = model->k;
+    qmodel->normalization = model->normalization;
+    qmodel->Q = nullptr;
+    qmodel->S = nullptr;
+    qmodel->J = nullptr;
+    if(model->J != nullptr)
     {
-        for(ffm_int f = 0; f < model->m; f++)
-        {
-            f_out << "w" << j << "," << f << " ";
-            for(ffm_int d = 0; d < model->k; d++, ptr++)
-                f_out << *ptr << " ";
-            f_out << "\n";
-        }
+        qmodel->J = new ffm_int[model->n];
+        copy(model->J, model->J+model->n, qmodel->J);
     }
 
-    return 0;
-}
-
-ffm_model* ffm_load_model(char const *path)
-{
-    ifstream f_in(path);
-    if(!f_in.is_open())
-        return nullptr;
-
-    string dummy;
-
-    ffm_model *model = new ffm_model;
-    model->W = nullptr;
-
-    f_in >> dummy >> model->n >> dummy >> model->m >> dummy >> model->k 
-         >> dummy >> model->normalization;
-
     try
     {
-        model->W = malloc_aligned_float((ffm_long)model->m*model->n*model->k);
+        qmodel->Q = (signed char*)malloc_aligned(nr_rows*qk);
+        qmodel->S = malloc_aligned_float(nr_rows);
     }
     catch(bad_alloc const &e)
     {
-        ffm_destroy_model(&model);
+        ffm_destroy_qmodel(&qmodel);
         return nullptr;
     }
 
-    ffm_float *ptr = model->W;
-    for(ffm_int j = 0; j < model->n; j++)
+#if defined USEOMP
+#pragma omp parallel for schedule(static)
+#endif
+    for(ffm_long r = 0; r < nr_rows; r++)
     {
-        for(ffm_int f = 0; f < model->m; f++)
+        ffm_float const *w = model->W + r*model->k;
+        signed char *q = qmodel->Q + r*qk;
+
+        ffm_float w_max = 0;
+        for(ffm_int d = 0; d < model->k; d++)
+            w_max = max(w_max, abs(w[d]));
+
+        ffm_float s = w_max/127;
+        ffm_float inv_s = s > 0? 1/s : 0;
+        for(ffm_int d = 0; d < model->k; d++)
         {
-            f_in >> dummy;
-            for(ffm_int d = 0; d < model->k; d++, ptr++)
-                f_in >> *ptr;
+            ffm_float v = round(w[d]*inv_s);
+            q[d] = (signed char)min(max(v, -127.0f), 127.0f);
         }
-    }
+        for(ffm_int d = model->k; d < qk; d++)
+            q[d] = 0;
 
-    return model;
-}
+        qmodel->S[r] = s;
+    }
 
-void ffm_destroy_model(ffm_model **model)
-{
-    if(model == nullptr || *model == nullptr)
-        return;
-#ifdef _WIN32
-    _aligned_free((*model)->W);
-#else
-    free((*model)->W);
-#endif
-    delete *model;
-    *model = nullptr;
+    return qmodel;
 }
 
-ffm_parameter ffm_get_default_param()
+ffm_int ffm_save_qmodel(ffm_qmodel *model, char const *path)
 {
-    ffm_parameter param;
+    FILE *f = fopen(path, "wb");
+    if(f == nullptr)
+        return 1;
 
-    param.eta = 0.2;
-    param.lambda = 0.00002;
-    param.nr_iters = 15;
-    param.k = 4;
-    param.nr_threads = 1;
-    param.quiet = false;
-    param.normalization = true;
-    param.random = true;
-    param.auto_stop = false;
+    ffm_int qk = get_qk(model->k);
+    ffm_long nr_rows = (ffm_long)model->n*model->m;
+    ffm_int normalization = model->normalization;
+    ffm_int has_remap = model->J != nullptr;
+
+    fwrite(kQMODEL_MAGIC, 1, sizeof(kQMODEL_MAGIC), f);
+    fwrite(&kQMODEL_VERSION, sizeof(ffm_int), 1, f);
+    fwrite(&model->n, sizeof(ffm_int), 1, f);
+    fwrite(&model->m, sizeof(ffm_int), 1, f);
+    fwrite(&model->k, sizeof(ffm_int), 1, f);
+    fwrite(&normalization, sizeof(ffm_int), 1, f);
+    fwrite(&has_remap, sizeof(ffm_int), 1, f);
+    fwrite(model->S, sizeof(ffm_float), nr_rows, f);
+    fwrite(model->Q, 1, nr_rows*qk, f);
+    if(has_remap)
+        fwrite(model->J, sizeof(ffm_int), model->n, f);
+
+    bool failed = ferror(f) != 0;
+    if(fclose(f) != 0 || failed)
+        return 1;
 
-    return param;
+    return 0;
 }
 
-ffm_model* ffm_train_with_validation(ffm_problem *tr, ffm_problem *va, ffm_parameter param)
+ffm_qmodel* ffm_load_qmodel(char const *path)
 {
-    vector<ffm_int> order(tr->l);
-    for(ffm_int i = 0; i < tr->l; i++)
-        order[i] = i;
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return nullptr;
 
-    shared_ptr<ffm_model> model = train(tr, order, param, va);
+    char magic[sizeof(kQMODEL_MAGIC)];
+    ffm_int version = 0;
+    if(fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+       memcmp(magic, kQMODEL_MAGIC, sizeof(magic)) != 0 ||
+       fread(&version, sizeof(ffm_int), 1, f) != 1 ||
+       version != kQMODEL_VERSION)
+    {
+        fclose(f);
+        return nullptr;
+    }
 
-    ffm_model *model_ret = new ffm_model;
+    ffm_qmodel *model = new ffm_qmodel;
+    model->Q = nullptr;
+    model->S = nullptr;
+    model->J = nullptr;
+
+    ffm_int normalization = 0, has_remap = 0;
+    if(fread(&model->n, sizeof(ffm_int), 1, f) != 1 ||
+       fread(&model->m, sizeof(ffm_int), 1, f) != 1 ||
+       fread(&model->k, sizeof(ffm_int), 1, f) != 1 ||
+       fread(&normalization, sizeof(ffm_int), 1, f) != 1 ||
+       fread(&has_remap, sizeof(ffm_int), 1, f) != 1 ||
+       model->n <= 0 || model->m <= 0 || model->k <= 0)
+    {
+        fclose(f);
+        ffm_destroy_qmodel(&model);
+        return nullptr;
+    }
+    model->normalization = normalization != 0;
 
-    model_ret->n = model->n;
-    model_ret->m = model->m;
-    model_ret->k = model->k;
-    model_ret->normalization = model->normalization;
+    ffm_int qk = get_qk(model->k);
+    ffm_long nr_rows = (ffm_long)model->n*model->m;
 
-    model_ret->W = model->W;
-    model->W = nullptr;
+    try
+    {
+        model->S = malloc_aligned_float(nr_rows);
+        model->Q = (signed char*)malloc_aligned(nr_rows*qk);
+        if(has_remap)
+            model->J = new ffm_int[model->n];
+    }
+    catch(bad_alloc const &e)
+    {
+        fclose(f);
+        ffm_destroy_qmodel(&model);
+        return nullptr;
+    }
 
-    return model_ret;
-}
+    if(fread(model->S, sizeof(ffm_float), nr_rows, f) != (size_t)nr_rows ||
+       fread(model->Q, 1, nr_rows*qk, f) != (size_t)(nr_rows*qk) ||
+       (has_remap && fread(model->J, sizeof(ffm_int), model->n, f) != (size_t)model->n))
+    {
+        fclose(f);
+        ffm_destroy_qmodel(&model);
+        return nullptr;
+    }
 
-ffm_model* ffm_train(ffm_problem *prob, ffm_parameter param)
-{
-    return ffm_train_with_validation(prob, nullptr, param);
+    fclose(f);
+
+    return model;
 }
 
-ffm_model* ffm_train_with_validation_on_disk(
-    char const *tr_path,
-    char const *va_path,
-    ffm_parameter param)
+bool ffm_is_qmodel(char const *path)
 {
-    shared_ptr<ffm_model> model = train_on_disk(tr_path, va_path, param);
-
-    ffm_model *model_ret = new ffm_model;
-
-    model_ret->n = model->n;
-    model_ret->m = model->m;
-    model_ret->k = model->k;
-    model_ret->normalization = model->normalization;
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return false;
 
-    model_ret->W = model->W;
-    model->W = nullptr;
+    char magic[sizeof(kQMODEL_MAGIC)];
+    bool is_qmodel = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+                     memcmp(magic, kQMODEL_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
 
-    return model_ret;
+    return is_qmodel;
 }
 
-ffm_model* ffm_train_on_disk(char const *prob_path, ffm_parameter param)
+void ffm_destroy_qmodel(ffm_qmodel **model)
 {
-    return ffm_train_with_validation_on_disk(prob_path, "", param);
+    if(model == nullptr || *model == nullptr)
+        return;
+    free_aligned((*model)->Q);
+    free_aligned((*model)->S);
+    delete[] (*model)->J;
+    delete *model;
+    *model = nullptr;
 }
 
-ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model)
+ffm_float ffm_qpredict(ffm_node *begin, ffm_node *end, ffm_qmodel *model)
 {
+    thread_local vector<ffm_node> buffer;
+    remap_nodes(begin, end, model->J, model->n, buffer);
+
     ffm_float r = 1;
     if(model->normalization)
     {
@@ -917,8 +5558,8 @@ ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model)
         r = 1/r;
     }
 
-    ffm_long align0 = (ffm_long)model->k;
-    ffm_long align1 = (ffm_long)model->m*align0;
+    ffm_int qk = get_qk(model->k);
+    ffm_long align1 = (ffm_long)model->m;
 
     ffm_float t = 0;
     for(ffm_node *N1 = begin; N1 != end; N1++)
@@ -937,52 +5578,45 @@ ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model)
             if(j2 >= model->n || f2 >= model->m)
                 continue;
 
-            ffm_float *w1 = model->W + j1*align1 + f2*align0;
-            ffm_float *w2 = model->W + j2*align1 + f1*align0;
+            ffm_long r1 = j1*align1 + f2;
+            ffm_long r2 = j2*align1 + f1;
 
-            ffm_float v = v1*v2*r;
+            ffm_int dot = qdot(model->Q + r1*qk, model->Q + r2*qk, qk);
 
-            for(ffm_int d = 0; d < model->k; d++)
-                t += w1[d]*w2[d]*v;
+            t += dot*model->S[r1]*model->S[r2]*v1*v2*r;
         }
     }
 
     return 1/(1+exp(-t));
 }
 
+// The folds are trained concurrently on the shared problem (see
+// split_threads), and the held-out instances of each fold are scored in one
+// batch.
 ffm_float ffm_cross_validation(
     ffm_problem *prob, 
     ffm_int nr_folds,
     ffm_parameter param)
 {
-#if defined USEOMP
-    ffm_int old_nr_threads = omp_get_num_threads();
-    omp_set_num_threads(param.nr_threads);
-#endif
-
     bool quiet = param.quiet;
     param.quiet = true;
+    ffm_int nr_concurrent = split_threads(nr_folds, param);
 
     vector<ffm_int> order(prob->l);
     for(ffm_int i = 0; i < prob->l; i++)
         order[i] = i;
     random_shuffle(order.begin(), order.end());
 
-    if(!quiet)
-    {
-        cout.width(4);
-        cout << "fold";
-        cout.width(13);
-        cout << "logloss";
-        cout << endl;
-    }
+    Rows rows = get_rows(*prob);
 
-    ffm_double loss = 0;
     ffm_int nr_instance_per_fold = prob->l/nr_folds;
-    for(ffm_int fold = 0; fold < nr_folds; fold++)
+    vector<ffm_long> sizes(nr_folds);
+
+    vector<ffm_double> losses = run_folds(nr_folds, nr_concurrent, [&] (ffm_int fold)
     {
         ffm_int begin = fold*nr_instance_per_fold;
         ffm_int end = min(begin + nr_instance_per_fold, prob->l);
+        sizes[fold] = end-begin;
 
         vector<ffm_int> order1;
         for(ffm_int i = 0; i < begin; i++)
@@ -992,54 +5626,67 @@ ffm_float ffm_cross_validation(
 
         shared_ptr<ffm_model> model = train(prob, order1, param);
 
-        ffm_double loss1 = 0;
-#if defined USEOMP
-#pragma omp parallel for schedule(static) reduction(+: loss1)
-#endif
+        vector<ffm_node> X;
+        vector<ffm_long> P(1, 0);
+        vector<ffm_float> Y;
         for(ffm_int ii = begin; ii < end; ii++)
         {
             ffm_int i = order[ii];
+            get_nodes(rows, i, X);
+            P.push_back(X.size());
+            Y.push_back(prob->Y[i]);
+        }
 
-            ffm_float y = prob->Y[i];
-            
-            ffm_node *begin = &prob->X[prob->P[i]];
+        return batch_loss(X, P, Y, nullptr, *model, param.nr_threads);
+    });
 
-            ffm_node *end = &prob->X[prob->P[i+1]];
+    if(!quiet)
+        print_cv(losses, sizes, prob->l);
 
-            ffm_float y_bar = ffm_predict(begin, end, model.get());
+    return accumulate(losses.begin(), losses.end(), 0.0)/prob->l;
+}
 
-            loss1 -= y==1? log(y_bar) : log(1-y_bar);
-        }
-        loss += loss1;
+// The instances are assigned to folds at random as in ffm_cross_validation;
+// each fold trains with train_on_disk skipping its own instances, and then
+// scores them in a second pass over the file.
+ffm_float ffm_cross_validation_on_disk(
+    char const *path, 
+    ffm_int nr_folds,
+    ffm_parameter param)
+{
+    bool quiet = param.quiet;
+    param.quiet = true;
+    ffm_int nr_concurrent = split_threads(nr_folds, param);
 
-        if(!quiet)
-        {
-            cout.width(4);
-            cout << fold;
-            cout.width(13);
-            cout << fixed << setprecision(4) << loss1 / (end-begin);
-            cout << endl;
-        }
-    }
+    FILE *f = fopen(path, "rb");
+    if(f == nullptr)
+        return 0;
+    vector<ffm_long> chunk_begins;
+    get_chunk_offsets(f, &chunk_begins);
+    fclose(f);
 
-    if(!quiet)
+    ffm_long l = chunk_begins.back();
+
+    vector<ffm_int> order(l);
+    iota(order.begin(), order.end(), 0);
+    random_shuffle(order.begin(), order.end());
+
+    ffm_long nr_instance_per_fold = l/nr_folds;
+    vector<ffm_int> fold_of(l, -1);
+    for(ffm_long ii = 0; ii < nr_instance_per_fold*nr_folds; ii++)
+        fold_of[order[ii]] = (ffm_int)(ii/nr_instance_per_fold);
+    vector<ffm_long> sizes(nr_folds, nr_instance_per_fold);
+
+    vector<ffm_double> losses = run_folds(nr_folds, nr_concurrent, [&] (ffm_int fold)
     {
-        cout.width(17);
-        cout.fill('=');
-        cout << "" << endl;
-        cout.fill(' ');
-        cout.width(4);
-        cout << "avg";
-        cout.width(13);
-        cout << fixed << setprecision(4) << loss/prob->l;
-        cout << endl;
-    }
+        shared_ptr<ffm_model> model = train_on_disk(path, "", param, &fold_of, fold);
+        return evaluate_fold_on_disk(path, *model, fold_of, fold, param.nr_threads);
+    });
 
-#if defined USEOMP
-    omp_set_num_threads(old_nr_threads);
-#endif
+    if(!quiet)
+        print_cv(losses, sizes, l);
 
-    return loss/prob->l;
+    return accumulate(losses.begin(), losses.end(), 0.0)/l;
 }
 
 } // namespace ffm
@@ -13,6 +13,7 @@ typedef float ffm_float;
 typedef double ffm_double;
 typedef int ffm_int;
 typedef long long ffm_long;
+typedef unsigned int ffm_uint;
 
 struct ffm_node
 {
@@ -29,6 +30,10 @@ struct ffm_problem
     ffm_node *X;
     ffm_long *P;
     ffm_float *Y;
+    ffm_int *J;
+    unsigned char *F;
+    ffm_uint *I;
+    ffm_float *V;
 };
 
 struct ffm_model
@@ -38,6 +43,27 @@ struct ffm_model
     ffm_int k;
     ffm_float *W;
     bool normalization;
+    ffm_int *J;
+    unsigned char *mask;
+};
+
+struct ffm_qmodel
+{
+    ffm_int n;
+    ffm_int m;
+    ffm_int k;
+    signed char *Q;
+    ffm_float *S;
+    bool normalization;
+    ffm_int *J;
+};
+
+struct ffm_context;
+
+struct ffm_pair_mask
+{
+    ffm_int m;
+    unsigned char *allowed;
 };
 
 struct ffm_parameter
@@ -51,34 +77,111 @@ struct ffm_parameter
     bool normalization;
     bool random;
     bool auto_stop;
+    bool numa;
+    ffm_int prefetch_distance;
+    ffm_int block_size;
+    bool relayout;
+    bool deterministic;
+    struct ffm_pair_mask const *pair_mask;
+    ffm_float neg_sample_rate;
+};
+
+struct ffm_sweep_result
+{
+    ffm_model *model;
+    ffm_int nr_iters;
+    ffm_double tr_loss;
+    ffm_double va_loss;
 };
 
 ffm_problem* ffm_read_problem(char const *path);
 
+ffm_int ffm_parse_line(char const *begin, char const *end, ffm_float *y, ffm_node *X, ffm_int max_nodes);
+
 int ffm_read_problem_to_disk(char const *txt_path, char const *bin_path);
 
+bool ffm_is_bin_problem(char const *path);
+
+bool ffm_bin_problem_up_to_date(char const *txt_path, char const *bin_path);
+
 void ffm_destroy_problem(struct ffm_problem **prob);
 
+ffm_int ffm_compact_problem(struct ffm_problem *prob);
+
+void ffm_remap_problem(struct ffm_problem *prob);
+
+void ffm_apply_remap(struct ffm_problem *prob, struct ffm_problem const *ref);
+
 ffm_int ffm_save_model(ffm_model *model, char const *path);
 
+ffm_int ffm_save_txt_model(ffm_model *model, char const *path);
+
 ffm_model* ffm_load_model(char const *path);
 
 void ffm_destroy_model(struct ffm_model **model);
 
+ffm_pair_mask* ffm_read_pair_mask(char const *path);
+
+ffm_int ffm_save_pair_mask(struct ffm_pair_mask const *mask, char const *path);
+
+void ffm_destroy_pair_mask(struct ffm_pair_mask **mask);
+
+void ffm_set_pair_mask(struct ffm_model *model, struct ffm_pair_mask const *mask);
+
+void ffm_set_huge_pages(bool enable);
+
+void ffm_report_huge_pages();
+
 ffm_parameter ffm_get_default_param();
 
 ffm_model* ffm_train_with_validation(struct ffm_problem *Tr, struct ffm_problem *Va, struct ffm_parameter param);
 
 ffm_model* ffm_train(struct ffm_problem *prob, struct ffm_parameter param);
 
+ffm_int ffm_train_sweep(struct ffm_problem *Tr, struct ffm_problem *Va, struct ffm_parameter const *params, ffm_int nr_models, struct ffm_sweep_result *results);
+
 ffm_model* ffm_train_with_validation_on_disk(char const *Tr_path, char const *Va_path, struct ffm_parameter param);
 
 ffm_model* ffm_train_on_disk(char const *path, struct ffm_parameter param);
 
+ffm_model* ffm_train_with_checkpoint(struct ffm_problem *Tr, struct ffm_problem *Va, char const *init_path, char const *checkpoint_path, char const *delta_path, struct ffm_parameter param);
+
+ffm_model* ffm_train_with_checkpoint_on_disk(char const *Tr_path, char const *Va_path, char const *init_path, char const *checkpoint_path, char const *delta_path, struct ffm_parameter param);
+
+ffm_int ffm_apply_delta(char const *model_path, char const *delta_path);
+
+ffm_int ffm_train_stream(char const *path, char const *model_path, ffm_int n, ffm_int m, ffm_int snapshot_interval, struct ffm_parameter param);
+
+ffm_model* ffm_train_distributed(char const *Tr_path, char const *Va_path, ffm_int nr_workers, ffm_int nr_servers, struct ffm_parameter param);
+
 ffm_float ffm_predict(ffm_node *begin, ffm_node *end, ffm_model *model);
 
+ffm_float ffm_pair_contributions(ffm_node *begin, ffm_node *end, struct ffm_model *model, ffm_float *C);
+
+void ffm_predict_batch(ffm_node *X, ffm_long *P, ffm_float *R, ffm_int l, ffm_model *model, ffm_float *out, ffm_int nr_threads);
+
+ffm_context* ffm_create_context(ffm_node *begin, ffm_node *end, ffm_model *model);
+
+ffm_float ffm_predict_with_context(ffm_context *ctx, ffm_node *begin, ffm_node *end);
+
+void ffm_destroy_context(struct ffm_context **ctx);
+
+ffm_qmodel* ffm_quantize_model(ffm_model *model);
+
+ffm_int ffm_save_qmodel(ffm_qmodel *model, char const *path);
+
+ffm_qmodel* ffm_load_qmodel(char const *path);
+
+bool ffm_is_qmodel(char const *path);
+
+void ffm_destroy_qmodel(struct ffm_qmodel **model);
+
+ffm_float ffm_qpredict(ffm_node *begin, ffm_node *end, ffm_qmodel *model);
+
 ffm_float ffm_cross_validation(struct ffm_problem *prob, ffm_int nr_folds, struct ffm_parameter param);
 
+ffm_float ffm_cross_validation_on_disk(char const *path, ffm_int nr_folds, struct ffm_parameter param);
+
 #ifdef __cplusplus
 } // namespace ffm
 